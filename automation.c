@@ -0,0 +1,278 @@
+/* Copyright 2020-2021 Dustin DeWeese
+   This file is part of MidiPush.
+
+    MidiPush is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    MidiPush is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with MidiPush.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <float.h>
+
+#include "types.h"
+#include "startle/types.h"
+#include "startle/macros.h"
+#include "startle/support.h"
+#include "startle/test.h"
+
+#include "event_map.h"
+#include "automation.h"
+
+// Channel pressure and pitch bend are recorded as a curve rather than every message.
+// Within a beat only the last value is kept, and the beats of a gesture are simplified online
+// into straight segments (swing door), each within the tolerance of every value it replaces.
+// The end of each segment is stored as an event with EVENT_RAMP set,
+// and playback interpolates toward it. Points without EVENT_RAMP are steps.
+// A gesture ends when the value hasn't changed for AUTOMATION_GAP beats, or the beat wraps.
+
+#if INTERFACE
+#define EVENT_RAMP 0x02
+
+#define AUTOMATION_PRESSURE 0
+#define AUTOMATION_BEND 1
+#define AUTOMATION_KINDS 2
+#define AUTOMATION_GAP BEATS_PER_PAGE
+
+typedef struct automation_point {
+  unsigned int beat;
+  int value;
+  bool ramp;
+} automation_point_t;
+
+// recording state for one channel's pressure or bend
+typedef struct automation_lane {
+  bool active, started; // in a gesture, and its first point has been stored
+  automation_point_t anchor, last; // start of the current segment, and the latest value
+  automation_point_t prev; // the last value before the latest beat
+  float lo, hi; // range of slopes from the anchor that fit every value so far
+  unsigned int samples, points;
+} automation_lane_t;
+
+// playback state for one channel's pressure or bend
+typedef struct automation_ramp {
+  bool active;
+  uint16_t from, to;
+  int16_t from_value, to_value, sent;
+} automation_ramp_t;
+#endif
+
+static
+int kind_scale(unsigned int kind) {
+  return kind == AUTOMATION_BEND ? 128 : 1;
+}
+
+unsigned int automation_kind(uint8_t status) {
+  return (status & 0xf0) == 0xe0 ? AUTOMATION_BEND : AUTOMATION_PRESSURE;
+}
+
+int automation_event_value(const event_t *e) {
+  return automation_kind(e->msg[0]) == AUTOMATION_BEND ?
+    (e->msg[1] & 0x7f) | (e->msg[2] & 0x7f) << 7 :
+    e->msg[1];
+}
+
+event_t automation_event(unsigned int channel, unsigned int kind, automation_point_t p) {
+  event_t e = { .beat = p.beat, .flags = p.ramp ? EVENT_RAMP : 0 };
+  if(kind == AUTOMATION_BEND) {
+    p.value = clamp(0, 0x3fff, p.value);
+    e.msg[0] = 0xe0 | channel;
+    e.msg[1] = p.value & 0x7f;
+    e.msg[2] = (p.value >> 7) & 0x7f;
+  } else {
+    e.msg[0] = 0xd0 | channel;
+    e.msg[1] = clamp(0, 127, p.value);
+  }
+  return e;
+}
+
+static
+void restart(automation_lane_t *l, automation_point_t anchor) {
+  l->anchor = anchor;
+  l->lo = -FLT_MAX;
+  l->hi = FLT_MAX;
+}
+
+// end the segment at the last committed beat, on a line that fits every value it replaces
+static
+automation_point_t segment_end(const automation_lane_t *l) {
+  float slope = (l->lo + l->hi) / 2;
+  float dv = slope * (l->prev.beat - l->anchor.beat);
+  return (automation_point_t) {
+    .beat = l->prev.beat,
+    .value = l->anchor.value + (int)(dv + (dv >= 0 ? 0.5f : -0.5f)),
+    .ramp = true
+  };
+}
+
+// fit the value into the current segment, or end the segment and return its end
+static
+bool extend(automation_lane_t *l, automation_point_t p, int tolerance, automation_point_t *out) {
+  float db = p.beat - l->anchor.beat;
+  float lo = max(l->lo, (p.value - tolerance - l->anchor.value) / db);
+  float hi = min(l->hi, (p.value + tolerance - l->anchor.value) / db);
+  if(lo <= hi) {
+    l->lo = lo;
+    l->hi = hi;
+    return false;
+  }
+  *out = segment_end(l);
+  restart(l, *out);
+  extend(l, p, tolerance, out); // always fits a new segment
+  return true;
+}
+
+// commit the latest beat's value into the curve
+static
+unsigned int commit(automation_lane_t *l, int tolerance, automation_point_t *out) {
+  if(!l->started) { // the first point is a step
+    l->started = true;
+    l->prev = l->last;
+    restart(l, l->last);
+    out[0] = l->last;
+    return 1;
+  }
+  unsigned int n = extend(l, l->last, tolerance, out) ? 1 : 0;
+  l->prev = l->last;
+  return n;
+}
+
+// end the gesture, returning up to two points that finish it
+unsigned int automation_flush(automation_lane_t *l, unsigned int kind, unsigned int tolerance,
+                              automation_point_t *out) {
+  if(!l->active) return 0;
+  unsigned int n = commit(l, tolerance * kind_scale(kind), out);
+  if(l->prev.beat != l->anchor.beat) {
+    out[n++] = segment_end(l);
+  }
+  l->active = false;
+  l->points += n;
+  return n;
+}
+
+// record a value, returning up to two points to store
+unsigned int automation_sample(automation_lane_t *l, unsigned int kind, unsigned int tolerance,
+                               unsigned int beat, int value, automation_point_t *out) {
+  int tol = tolerance * kind_scale(kind);
+  unsigned int n = 0;
+  l->samples++;
+  if(l->active && beat == l->last.beat) {
+    l->last.value = value;
+    return 0;
+  }
+  if(l->active && (beat < l->last.beat || beat - l->last.beat > AUTOMATION_GAP)) {
+    n = automation_flush(l, kind, tolerance, out);
+  }
+  if(!l->active) {
+    l->active = true;
+    l->started = false;
+    l->last = (automation_point_t) { .beat = beat, .value = value };
+    return n;
+  }
+
+  // the value held until the beat before this one
+  unsigned int m = commit(l, tol, out + n);
+  if(beat - l->prev.beat > 1) {
+    l->last = (automation_point_t) { .beat = beat - 1, .value = l->prev.value };
+    m += commit(l, tol, out + n + m);
+  }
+  l->points += m;
+  l->last = (automation_point_t) { .beat = beat, .value = value };
+  return n + m;
+}
+
+// value of the ramp at the beat, or -1 if the beat isn't within it
+int automation_ramp_value(const automation_ramp_t *r, unsigned int beat) {
+  if(!r->active || beat < r->from || beat > r->to) return -1;
+  if(r->to == r->from) return r->to_value;
+  return r->from_value + ((int)r->to_value - r->from_value) * (int)(beat - r->from) / (int)(r->to - r->from);
+}
+
+// find the next point of the same kind on the channel after the beat, within the first len beats
+// returns false if there are none
+bool automation_next(event_map_t *m, uint8_t status, unsigned int beat, unsigned int len, event_t *next) {
+  unsigned int channel = status & 0x0f, kind = automation_kind(status);
+  size_t n;
+  event_t *e = event_map_channel(m, channel, &n);
+  uint32_t base = m->start[EVENT_KEY(channel, 0)];
+  uint32_t after = m->start[EVENT_KEY(channel, beat + 1)] - base, end = m->start[EVENT_KEY(channel, len)] - base;
+  COUNTUP(k, end) {
+    const event_t *x = &e[(after + k) % end];
+    if(ONEOF(x->msg[0] & 0xf0, 0xd0, 0xe0) && automation_kind(x->msg[0]) == kind &&
+       !(x->flags & EVENT_DELETED)) {
+      *next = *x;
+      return true;
+    }
+  }
+  return false;
+}
+
+// number of stored points of the kind on the channel
+unsigned int automation_points(event_map_t *m, unsigned int channel, unsigned int kind) {
+  size_t n;
+  const event_t *e = event_map_channel(m, channel, &n);
+  unsigned int cnt = 0;
+  COUNTUP(i, n) {
+    if(ONEOF(e[i].msg[0] & 0xf0, 0xd0, 0xe0) && automation_kind(e[i].msg[0]) == kind &&
+       !(e[i].flags & EVENT_DELETED)) cnt++;
+  }
+  return cnt;
+}
+
+TEST(automation) {
+  automation_lane_t l = {0};
+  automation_point_t out[64];
+  unsigned int n = 0;
+
+  // a straight ramp over many messages is two points
+  RANGEUP(b, 10, 40) {
+    LOOP(4) n += automation_sample(&l, AUTOMATION_PRESSURE, 2, b, (b - 10) * 4, out + n);
+  }
+  n += automation_flush(&l, AUTOMATION_PRESSURE, 2, out + n);
+  if(n != 2 || out[0].beat != 10 || out[0].ramp || out[1].beat != 39 || out[1].value != 116 || !out[1].ramp) return -1;
+
+  // up then down, with a held value
+  n = 0;
+  RANGEUP(b, 0, 10) n += automation_sample(&l, AUTOMATION_PRESSURE, 2, b, b * 10, out + n);
+  n += automation_sample(&l, AUTOMATION_PRESSURE, 2, 20, 0, out + n);
+  n += automation_flush(&l, AUTOMATION_PRESSURE, 2, out + n);
+  if(n != 4 || out[1].beat != 9 || abs(out[1].value - 90) > 2) return -2;
+  if(out[2].beat != 19 || abs(out[2].value - 90) > 2 || out[3].beat != 20 || out[3].value != 0) return -3;
+
+  // every recorded value is within the tolerance of the curve
+  n = 0;
+  int values[100];
+  srand(2);
+  int v = 64;
+  COUNTUP(b, LENGTH(values)) {
+    v = clamp(0, 127, v + rand() % 9 - 4);
+    values[b] = v;
+    n += automation_sample(&l, AUTOMATION_PRESSURE, 3, b, v, out + n);
+    if(n > LENGTH(out) - 3) return -4;
+  }
+  n += automation_flush(&l, AUTOMATION_PRESSURE, 3, out + n);
+  printf("%d values in %d points\n", (int)LENGTH(values), n);
+  COUNTUP(i, n - 1) {
+    automation_ramp_t r = {
+      .active = true,
+      .from = out[i].beat, .to = out[i + 1].beat,
+      .from_value = out[i].value, .to_value = out[i + 1].value
+    };
+    RANGEUP(b, r.from, r.to + 1) {
+      if(abs(automation_ramp_value(&r, b) - values[b]) > 3 + 1) return -5;
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,120 @@
+#ifndef BEAT_FRAME_H
+#define BEAT_FRAME_H
+
+#include "vec128b.h"
+
+// The notes of all 16 channels at a beat.
+// With AVX2, each operation works on two channels at a time.
+// Otherwise each channel uses the vec128b operations (SSE2, NEON, or scalar).
+
+#if !defined(VEC128B_SCALAR) && defined(__AVX2__)
+#include <immintrin.h>
+#define BEAT_FRAME_AVX2 1
+#endif
+
+#define BEAT_FRAME_CHANNELS 16
+
+typedef struct {
+  vec128b ch[BEAT_FRAME_CHANNELS];
+} beat_frame_t;
+
+#if BEAT_FRAME_AVX2
+#define BEAT_FRAME_PAIRS (BEAT_FRAME_CHANNELS / 2)
+
+static inline
+__m256i beat_frame_load(const beat_frame_t *f, int pair) {
+  return _mm256_loadu_si256((const __m256i *)&f->ch[pair * 2]);
+}
+
+static inline
+void beat_frame_store(beat_frame_t *f, int pair, __m256i x) {
+  _mm256_storeu_si256((__m256i *)&f->ch[pair * 2], x);
+}
+
+// all ones in the lanes of the channels of the pair that are in the mask
+static inline
+__m256i beat_frame_lane_mask(unsigned int mask, int pair) {
+  long long lo = -(long long)(mask >> (pair * 2) & 1);
+  long long hi = -(long long)(mask >> (pair * 2 + 1) & 1);
+  return _mm256_set_epi64x(hi, hi, lo, lo);
+}
+#endif
+
+static inline
+void beat_frame_or(beat_frame_t *a, const beat_frame_t *b) {
+#if BEAT_FRAME_AVX2
+  COUNTUP(i, BEAT_FRAME_PAIRS) {
+    beat_frame_store(a, i, _mm256_or_si256(beat_frame_load(a, i), beat_frame_load(b, i)));
+  }
+#else
+  COUNTUP(c, BEAT_FRAME_CHANNELS) {
+    vec128b_or(&a->ch[c], &b->ch[c]);
+  }
+#endif
+}
+
+static inline
+void beat_frame_and_not(beat_frame_t *a, const beat_frame_t *b) {
+#if BEAT_FRAME_AVX2
+  COUNTUP(i, BEAT_FRAME_PAIRS) {
+    beat_frame_store(a, i, _mm256_andnot_si256(beat_frame_load(b, i), beat_frame_load(a, i)));
+  }
+#else
+  COUNTUP(c, BEAT_FRAME_CHANNELS) {
+    vec128b_and_not(&a->ch[c], &b->ch[c]);
+  }
+#endif
+}
+
+// clear the channels not in the mask
+static inline
+void beat_frame_mask(beat_frame_t *a, unsigned int mask) {
+#if BEAT_FRAME_AVX2
+  COUNTUP(i, BEAT_FRAME_PAIRS) {
+    beat_frame_store(a, i, _mm256_and_si256(beat_frame_load(a, i), beat_frame_lane_mask(mask, i)));
+  }
+#else
+  COUNTUP(c, BEAT_FRAME_CHANNELS) {
+    if(!(mask & 1u << c)) vec128b_set_zero(&a->ch[c]);
+  }
+#endif
+}
+
+// OR the channels in the mask into out
+static inline
+void beat_frame_reduce(const beat_frame_t *a, unsigned int mask, vec128b *out) {
+#if BEAT_FRAME_AVX2
+  __m256i acc = _mm256_setzero_si256();
+  COUNTUP(i, BEAT_FRAME_PAIRS) {
+    acc = _mm256_or_si256(acc, _mm256_and_si256(beat_frame_load(a, i), beat_frame_lane_mask(mask, i)));
+  }
+  __m128i r = _mm_or_si128(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+  r = _mm_or_si128(r, _mm_loadu_si128((const __m128i *)out));
+  _mm_storeu_si128((__m128i *)out, r);
+#else
+  COUNTUP(c, BEAT_FRAME_CHANNELS) {
+    if(mask & 1u << c) vec128b_or(out, &a->ch[c]);
+  }
+#endif
+}
+
+// mask of the channels with any bits set
+static inline
+unsigned int beat_frame_nonzero(const beat_frame_t *a) {
+  unsigned int mask = 0;
+#if BEAT_FRAME_AVX2
+  COUNTUP(i, BEAT_FRAME_PAIRS) {
+    __m256i zero = _mm256_cmpeq_epi64(beat_frame_load(a, i), _mm256_setzero_si256());
+    unsigned int z = _mm256_movemask_pd(_mm256_castsi256_pd(zero));
+    mask |= ((z & 3) != 3 ? 1u : 0) << (i * 2);
+    mask |= ((z & 12) != 12 ? 1u : 0) << (i * 2 + 1);
+  }
+#else
+  COUNTUP(c, BEAT_FRAME_CHANNELS) {
+    if(!vec128b_zero(&a->ch[c])) mask |= 1u << c;
+  }
+#endif
+  return mask;
+}
+
+#endif
@@ -0,0 +1,153 @@
+/* Copyright 2020-2021 Dustin DeWeese
+   This file is part of MidiPush.
+
+    MidiPush is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    MidiPush is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with MidiPush.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <limits.h>
+
+#include "startle/types.h"
+#include "startle/macros.h"
+#include "startle/support.h"
+#include "startle/test.h"
+
+#include "coalesce.h"
+
+// Continuous input (channel pressure, pitch bend, and the relative encoders)
+// is passed on at most once per window for each channel or control.
+// In between, only the latest value is held, or the sum of the encoder steps.
+// Anything else flushes what's held first, so order is kept around notes.
+
+#if INTERFACE
+#define COALESCE_WINDOW_MS 8
+#define COALESCE_CONTROLS 4
+#define COALESCE_SLOTS (32 + COALESCE_CONTROLS)
+
+typedef struct coalesce {
+  int window_ms;
+  uint64_t pending;
+  long long sent_ms[COALESCE_SLOTS];
+  uint8_t msg[COALESCE_SLOTS][3];
+  unsigned int in, out; // messages received and passed on
+} coalesce_t;
+#endif
+
+// relative encoders: bpm, smoothing, program, volume
+static const uint8_t coalesce_controls[COALESCE_CONTROLS] = { 14, 71, 78, 79 };
+
+void coalesce_init(coalesce_t *c, int window_ms) {
+  memset(c, 0, sizeof(*c));
+  c->window_ms = window_ms;
+  COUNTUP(i, COALESCE_SLOTS) {
+    c->sent_ms[i] = LLONG_MIN / 2;
+  }
+}
+
+// slot for the message, or -1 if it can't be coalesced
+static
+int slot(uint8_t status, const uint8_t *data) {
+  switch(status & 0xf0) {
+  case 0xd0: return status & 0x0f;
+  case 0xe0: return 16 + (status & 0x0f);
+  case 0xb0:
+    COUNTUP(i, COALESCE_CONTROLS) {
+      if(data[0] == coalesce_controls[i]) return 32 + i;
+    }
+  }
+  return -1;
+}
+
+static
+int relative(uint8_t val) {
+  return val >= 64 ? val - 128 : val;
+}
+
+// returns true if the message is held, otherwise it should be passed on now
+bool coalesce_put(coalesce_t *c, uint8_t status, const uint8_t *data, long long now) {
+  int i = slot(status, data);
+  c->in++;
+  if(i < 0 || c->window_ms <= 0) {
+    c->out++;
+    return false;
+  }
+  uint8_t *msg = c->msg[i];
+  if(!(c->pending & 1ull << i)) {
+    if(now - c->sent_ms[i] >= c->window_ms) {
+      c->sent_ms[i] = now;
+      c->out++;
+      return false;
+    }
+    msg[0] = status;
+    msg[1] = data[0];
+    msg[2] = 0;
+    c->pending |= 1ull << i;
+  }
+  if((status & 0xf0) == 0xb0) {
+    msg[2] = clamp(-63, 63, relative(msg[2]) + relative(data[1])) & 0x7f;
+  } else {
+    msg[1] = data[0];
+    if((status & 0xf0) == 0xe0) msg[2] = data[1];
+  }
+  return true;
+}
+
+// take a held message that's due, or any if all is set
+// returns false when there are none
+bool coalesce_take(coalesce_t *c, long long now, bool all, uint8_t *msg) {
+  uint64_t p = c->pending;
+  while(p) {
+    int i = __builtin_ctzll(p);
+    p &= p - 1;
+    if(all || now - c->sent_ms[i] >= c->window_ms) {
+      c->pending &= ~(1ull << i);
+      c->sent_ms[i] = now;
+      memcpy(msg, c->msg[i], sizeof(c->msg[i]));
+      c->out++;
+      return true;
+    }
+  }
+  return false;
+}
+
+TEST(coalesce) {
+  coalesce_t c;
+  uint8_t msg[3];
+  coalesce_init(&c, 8);
+
+  // the first is passed on, the rest held until the window ends
+  if(coalesce_put(&c, 0xd1, (uint8_t []) { 10, 0 }, 0)) return -1;
+  RANGEUP(v, 11, 20) {
+    if(!coalesce_put(&c, 0xd1, (uint8_t []) { v, 0 }, 2)) return -2;
+  }
+  if(coalesce_take(&c, 4, false, msg)) return -3;
+  if(!coalesce_take(&c, 8, false, msg) || msg[0] != 0xd1 || msg[1] != 19) return -4;
+  if(coalesce_take(&c, 8, true, msg)) return -5;
+
+  // encoder steps add up
+  coalesce_put(&c, 0xb0, (uint8_t []) { 79, 1 }, 100);
+  coalesce_put(&c, 0xb0, (uint8_t []) { 79, 1 }, 101);
+  coalesce_put(&c, 0xb0, (uint8_t []) { 79, 1 }, 102);
+  coalesce_put(&c, 0xb0, (uint8_t []) { 79, 127 }, 103);
+  if(!coalesce_take(&c, 103, true, msg) || msg[1] != 79 || msg[2] != 1) return -6;
+
+  // notes aren't held
+  if(coalesce_put(&c, 0x90, (uint8_t []) { 60, 100 }, 103)) return -7;
+  printf("in %u, out %u\n", c.in, c.out);
+  if(c.in != 15 || c.out != 5) return -8;
+  return 0;
+}
@@ -0,0 +1,35 @@
+/* Copyright 2016 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. */
+
+#ifndef DTASK_GEN
+#define BENCH_TASKS_RUN_FUNCTIONS
+#include "bench_tasks.h"
+#endif
+
+// a graph of BENCH_TASKS tasks, where task i depends on tasks i - 1 and i / 2
+// bench_chain.inc is generated by the Makefile, defining each task after t0 as:
+//
+// DTASK(ti, unsigned int) {
+//   *DREF(ti) = *DREF(ti-1) + *DREF(ti/2);
+//   return true;
+// }
+
+DTASK_GROUP(bench_tasks)
+
+DTASK(t0, unsigned int) {
+  *DREF(t0) += 1;
+  return true;
+}
+
+#include "bench_chain.inc"
@@ -0,0 +1,131 @@
+/* Copyright 2016 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#ifndef DTASK_GEN
+#include "bench_tasks.h"
+#endif
+
+#define RUNS 100000
+#define BATCH 8
+
+bench_tasks_state_t bench_state = DTASK_STATE(bench_tasks, NULL, 0);
+
+static long long time_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ll + ts.tv_nsec;
+}
+
+static unsigned int set_count(dtask_set_t s) {
+  unsigned int n = 0;
+  for(unsigned int k = 0; k < DTASK_SET_WORDS; k++) {
+    n += __builtin_popcountll(dtask_set_word(s, k));
+  }
+  return n;
+}
+
+// values of the tasks after t0 is run the given number of times
+static unsigned int expected(unsigned int id, unsigned int runs) {
+  static unsigned int v[BENCH_TASKS];
+  v[0] = runs;
+  for(unsigned int i = 1; i <= id; i++) {
+    v[i] = v[i - 1] + v[i / 2];
+  }
+  return v[id];
+}
+
+int main(int argc, char **argv) {
+
+  (void)argc;
+  (void)argv;
+
+  dtask_state_t *state = (dtask_state_t *)&bench_state;
+  const unsigned int last = BENCH_TASKS_COUNT - 1;
+  const dtask_set_t all = DTASK_SET_BIT(BENCH_TASKS_COUNT - 1);
+  const dtask_set_t half = DTASK_SET_BIT(BENCH_TASKS_COUNT / 2);
+
+  // every task runs
+  dtask_switch(state, all);
+  long long t0 = time_ns();
+  for(int i = 0; i < RUNS; i++) {
+    dtask_run(state, T0);
+  }
+  long long t1 = time_ns();
+  if(set_count(state->events) != BENCH_TASKS_COUNT ||
+     (&bench_state.t0)[last] != expected(last, RUNS)) {
+    printf("wrong result running all tasks\n");
+    return -1;
+  }
+
+  // the same, with the run function generated for t0
+  for(int i = 0; i < RUNS; i++) {
+    bench_tasks_run_t0(state);
+  }
+  long long t1_entry = time_ns();
+  if(set_count(state->events) != BENCH_TASKS_COUNT ||
+     (&bench_state.t0)[last] != expected(last, 2 * RUNS)) {
+    printf("wrong result from bench_tasks_run_t0\n");
+    return -1;
+  }
+
+  // only the first half is selected
+  dtask_switch(state, half);
+  dtask_run(state, T0);
+  if(set_count(state->events) != BENCH_TASKS_COUNT / 2 + 1) {
+    printf("wrong result running half of the tasks\n");
+    return -1;
+  }
+
+  // switching between the two selections
+  long long t2 = time_ns();
+  for(int i = 0; i < RUNS; i++) {
+    dtask_switch(state, i & 1 ? half : all);
+    dtask_select(state);
+  }
+  long long t3 = time_ns();
+
+  // the second half deferred, running once per batch of runs
+  dtask_switch(state, all);
+  dtask_defer(state, half);
+  if(set_count(dtask_run(state, T0)) != BENCH_TASKS_COUNT / 2 ||
+     set_count(dtask_run_deferred(state, DTASK_SET_EMPTY)) != BENCH_TASKS_COUNT - BENCH_TASKS_COUNT / 2) {
+    printf("wrong result running deferred tasks\n");
+    return -1;
+  }
+  long long t4 = time_ns();
+  dtask_set_t events = DTASK_SET_EMPTY;
+  for(int i = 0; i < RUNS; i++) {
+    events = dtask_set_or(events, bench_tasks_run_t0(state));
+    if(i % BATCH == BATCH - 1) {
+      if(set_count(dtask_run_deferred(state, events)) != BENCH_TASKS_COUNT) {
+        printf("wrong result from a batch\n");
+        return -1;
+      }
+      events = DTASK_SET_EMPTY;
+    }
+  }
+  long long t5 = time_ns();
+  dtask_defer(state, DTASK_SET_EMPTY);
+
+  printf("%3d tasks, %d word sets: run %6.1f ns (%4.2f ns/task), run_t0 %6.1f ns, "
+         "batched run_t0 %6.1f ns, select %6.1f ns\n",
+         BENCH_TASKS_COUNT, DTASK_SET_WORDS,
+         (double)(t1 - t0) / RUNS, (double)(t1 - t0) / RUNS / BENCH_TASKS_COUNT,
+         (double)(t1_entry - t1) / RUNS, (double)(t5 - t4) / RUNS, (double)(t3 - t2) / RUNS);
+  return 0;
+}
@@ -19,36 +19,36 @@
 
 void __dtask_noop(dtask_state_t *state) {}
 
-// find the first (lowest) id in the set
-// requires prev = previous id to optimize for NO_CLZ
+// find the first (lowest) id in a word of a set
+// requires prev = previous id in the word to optimize for NO_CLZ
 // used to iterate through bits using the set_foreach macro
 #ifdef NO_CLZ
-dtask_id_t dtask_set_find_first(dtask_set_t set, dtask_id_t prev) {
+dtask_id_t dtask_word_find_first(dtask_word_t word, dtask_id_t prev) {
   dtask_id_t x = prev;
-  dtask_set_t s = set << x;
+  dtask_word_t s = word << x;
   while(s) {
-    if(dtask_bit(0) & s) {
+    if(dtask_word_bit(0) & s) {
       return x;
     }
     x++;
     s <<= 1;
   }
-  return DTASK_BIT_WIDTH(dtask_set_t);
+  return DTASK_WORD_BITS;
 }
 #else
-#define dtask_set_find_first(set, prev) (__builtin_clzll(set))
+#define dtask_word_find_first(word, prev) (__builtin_clzll(word))
 #endif
 
-// find the last (highest) id in the set
-// requires prev = previous id to optimize for NO_CTZ
+// find the last (highest) id in a word of a set
+// requires prev = previous id in the word to optimize for NO_CTZ
 // used to iterate through bits using the set_foreach_rev macro
 #ifdef NO_CTZ
-dtask_id_t dtask_set_find_last(dtask_set_t set, dtask_id_t prev) {
-  dtask_id_t x = DTASK_MAX_ID - prev;
-  dtask_set_t s = set >> x;
+dtask_id_t dtask_word_find_last(dtask_word_t word, dtask_id_t prev) {
+  dtask_id_t x = DTASK_WORD_BITS - 1 - prev;
+  dtask_word_t s = word >> x;
   while(s) {
-    if(1 & set) {
-      return DTASK_MAX_ID - x;
+    if(1 & s) {
+      return DTASK_WORD_BITS - 1 - x;
     }
     x++;
     s >>= 1;
@@ -56,31 +56,40 @@ dtask_id_t dtask_set_find_last(dtask_set_t set, dtask_id_t prev) {
   return -1;
 }
 #else
-#define dtask_set_find_last(set, prev) (DTASK_MAX_ID - __builtin_ctzll(set))
+#define dtask_word_find_last(word, prev) (DTASK_WORD_BITS - 1 - __builtin_ctzll(word))
 #endif
 
-// call action for each id in set in increasing order
-#define set_foreach(set, action)                \
-  do {                                          \
-    dtask_id_t n = 0;                           \
-    dtask_set_t left = (set);                   \
-    while(left) {                               \
-      n = dtask_set_find_first(left, n);        \
-      action;                                   \
-      left &= ~dtask_bit(n);                    \
-    }                                           \
+// call action for each id n in set in increasing order
+// the set is read once, before the first action
+#define set_foreach(set, action)                                \
+  do {                                                          \
+    const dtask_set_t words = (set);                            \
+    for(unsigned int k = 0; k < DTASK_SET_WORDS; k++) {         \
+      dtask_id_t b = 0;                                         \
+      dtask_word_t left = dtask_set_word(words, k);             \
+      while(left) {                                             \
+        b = dtask_word_find_first(left, b);                     \
+        const dtask_id_t n = k * DTASK_WORD_BITS + b;           \
+        action;                                                 \
+        left &= ~dtask_word_bit(b);                             \
+      }                                                         \
+    }                                                           \
   } while(0)
 
-// call action for each id in set in decreasing order
-#define set_foreach_rev(set, action)            \
-  do {                                          \
-    dtask_id_t n = DTASK_MAX_ID;                \
-    dtask_set_t left = (set);                   \
-    while(left) {                               \
-      n = dtask_set_find_last(left, n);         \
-      action;                                   \
-      left &= ~dtask_bit(n);                    \
-    }                                           \
+// call action for each id n in set in decreasing order
+#define set_foreach_rev(set, action)                            \
+  do {                                                          \
+    const dtask_set_t words = (set);                            \
+    for(unsigned int k = DTASK_SET_WORDS; k-- > 0;) {           \
+      dtask_id_t b = DTASK_WORD_BITS - 1;                       \
+      dtask_word_t left = dtask_set_word(words, k);             \
+      while(left) {                                             \
+        b = dtask_word_find_last(left, b);                      \
+        const dtask_id_t n = k * DTASK_WORD_BITS + b;           \
+        action;                                                 \
+        left &= ~dtask_word_bit(b);                             \
+      }                                                         \
+    }                                                           \
   } while(0)
 
 // determine which dtasks should be selected based on which dtasks are enabled and disabled
@@ -91,11 +100,11 @@ static dtask_set_t dtask_requested(dtask_state_t *state) {
 
   // remove disabled dependents
   set_foreach(select->disabled,
-              requested &= ~tasks[n].all_dependents);
+              requested = dtask_set_and_not(requested, tasks[n].all_dependents));
 
   // add dependencies
   set_foreach(requested,
-              requested |= tasks[n].all_dependencies);
+              requested = dtask_set_or(requested, tasks[n].all_dependencies));
 
   return requested;
 }
@@ -121,15 +130,15 @@ void dtask_enable(dtask_state_t *state, dtask_set_t set)
   dtask_select_t *select = &state->select;
   const dtask_t *tasks = state->config.tasks;
 
-  if(set & ~select->enabled) {
+  if(dtask_set_any(dtask_set_and_not(set, select->enabled))) {
     select->dirty = true;
-    select->enabled |= set;
+    select->enabled = dtask_set_or(select->enabled, set);
 
     // clear conflicting disables
-    select->disabled &= ~set;
-    if(select->disabled) {
+    select->disabled = dtask_set_and_not(select->disabled, set);
+    if(dtask_set_any(select->disabled)) {
       set_foreach(set,
-                  select->disabled &= ~tasks[n].all_dependencies);
+                  select->disabled = dtask_set_and_not(select->disabled, tasks[n].all_dependencies));
     }
   }
 }
@@ -139,10 +148,10 @@ void dtask_enable(dtask_state_t *state, dtask_set_t set)
 void dtask_disable(dtask_state_t *state, dtask_set_t set)
 {
   dtask_select_t *select = &state->select;
-  if(set & ~select->disabled) {
+  if(dtask_set_any(dtask_set_and_not(set, select->disabled))) {
     select->dirty = true;
-    select->disabled |= set;
-    select->enabled &= ~set;
+    select->disabled = dtask_set_or(select->disabled, set);
+    select->enabled = dtask_set_and_not(select->enabled, set);
   }
 }
 
@@ -152,17 +161,17 @@ void dtask_clear(dtask_state_t *state, dtask_set_t set) {
   dtask_select_t *select = &state->select;
 
   // clear directly conflicting enables and recompute
-  if((select->enabled | select->disabled) & set) {
+  if(dtask_set_any(dtask_set_and(dtask_set_or(select->enabled, select->disabled), set))) {
     select->dirty = true;
-    select->enabled &= ~set;
-    select->disabled &= ~set;
+    select->enabled = dtask_set_and_not(select->enabled, set);
+    select->disabled = dtask_set_and_not(select->disabled, set);
   }
 }
 
 // request to enable dtasks in set and clear others
 // does not take effect until dtask_select()
 void dtask_switch(dtask_state_t *state, dtask_set_t set) {
-  dtask_clear(state, ~(dtask_set_t)0);
+  dtask_clear(state, dtask_set_all());
   dtask_enable(state, set);
 }
 
@@ -171,44 +180,144 @@ void dtask_select(dtask_state_t *state) {
   dtask_select_t *select = &state->select;
   if(select->dirty) {
     dtask_set_t requested = dtask_requested(state);
-    dtask_call_disable_functions(state, ~requested & select->selected);
-    dtask_call_enable_functions(state, requested & ~select->selected);
+    dtask_call_disable_functions(state, dtask_set_and_not(select->selected, requested));
+    dtask_call_enable_functions(state, dtask_set_and_not(requested, select->selected));
     select->selected = requested;
     select->dirty = false;
   }
 }
 
-// run selected dtasks starting with the initial set
-#ifndef NO_CLZ
-dtask_set_t dtask_run(dtask_state_t *state, dtask_set_t initial) {
-  dtask_select(state);
-
-  const dtask_set_t selected = state->select.selected;
+// run scheduled dtasks that are runnable, and their runnable dependents
+// selected dtasks that were scheduled but not runnable become pending
+#if !defined(NO_CLZ) && DTASK_SET_WORDS == 1
+static dtask_set_t dtask_run_scheduled(dtask_state_t *state, dtask_set_t initial, dtask_set_t runnable) {
   dtask_set_t
-    scheduled = initial & selected,
+    scheduled = initial & runnable,
+    held = initial,
     active = 0;
 
-  state->events = 0;
-
   while(scheduled) {
-    active = dtask_set_find_first(scheduled, active);
+    active = dtask_word_find_first(scheduled, active);
     const dtask_set_t id_bit = dtask_bit(active);
     const dtask_t *task = &state->config.tasks[active];
 
-    // run the task if scheduled
+    // run the task
     // on success, mark events and schedule dependents
-    if((id_bit & scheduled) &&
-       task->func(state)) {
+    if(DTASK_CALL(state, active, task->func)) {
       state->events |= id_bit;
-      scheduled |= task->dependents & selected;
+      scheduled |= task->dependents & runnable;
+      held |= task->dependents;
     }
     scheduled &= ~id_bit;
   }
+  state->select.pending |= held & state->select.selected & ~runnable;
+  return state->events;
+}
+#elif !defined(NO_CLZ)
+// dependents always have higher ids than their dependencies,
+// so each word is finished before moving on to the next
+static dtask_set_t dtask_run_scheduled(dtask_state_t *state, dtask_set_t initial, dtask_set_t runnable) {
+  dtask_set_t
+    scheduled = dtask_set_and(initial, runnable),
+    held = initial;
+
+  for(unsigned int k = 0; k < DTASK_SET_WORDS; k++) {
+    dtask_id_t active = 0;
+    while(scheduled.w[k]) {
+      active = dtask_word_find_first(scheduled.w[k], active);
+      const dtask_word_t id_bit = dtask_word_bit(active);
+      const dtask_t *task = &state->config.tasks[k * DTASK_WORD_BITS + active];
+
+      // run the task
+      // on success, mark events and schedule dependents
+      if(DTASK_CALL(state, k * DTASK_WORD_BITS + active, task->func)) {
+        state->events.w[k] |= id_bit;
+        for(unsigned int j = k; j < DTASK_SET_WORDS; j++) {
+          scheduled.w[j] |= task->dependents.w[j] & runnable.w[j];
+          held.w[j] |= task->dependents.w[j];
+        }
+      }
+      scheduled.w[k] &= ~id_bit;
+    }
+  }
+  state->select.pending =
+    dtask_set_or(state->select.pending,
+                 dtask_set_and_not(dtask_set_and(held, state->select.selected), runnable));
   return state->events;
 }
+#endif
+
+// run selected dtasks starting with the initial set
+#ifndef NO_CLZ
+dtask_set_t dtask_run(dtask_state_t *state, dtask_set_t initial) {
+  dtask_select(state);
+  state->events = DTASK_SET_EMPTY;
+  return dtask_run_scheduled(state, initial,
+                             dtask_set_and_not(state->select.selected, state->select.deferred));
+}
 #else
 dtask_set_t dtask_run(dtask_state_t *state, dtask_set_t initial) {
   dtask_select(state);
   return state->config.run(state, initial);
 }
 #endif
+
+// run pending deferred dtasks and their dependents
+// events should hold the events of the runs since the last call,
+// so that deferred dtasks see everything that happened in between
+// with NO_CLZ, only the events of this run are seen
+dtask_set_t dtask_run_deferred(dtask_state_t *state, dtask_set_t events) {
+  dtask_select(state);
+  dtask_select_t *select = &state->select;
+  const dtask_set_t pending = dtask_set_and(select->pending, select->selected);
+  select->pending = DTASK_SET_EMPTY;
+  if(!dtask_set_any(pending)) return events;
+#ifndef NO_CLZ
+  state->events = events;
+  return dtask_run_scheduled(state, pending, select->selected);
+#else
+  const dtask_set_t deferred = select->deferred;
+  select->deferred = DTASK_SET_EMPTY;
+  state->config.run(state, pending);
+  select->deferred = deferred;
+  return state->events = dtask_set_or(state->events, events);
+#endif
+}
+
+// hold dtasks in set and their dependents until dtask_run_deferred()
+// replaces the previously deferred set
+void dtask_defer(dtask_state_t *state, dtask_set_t set) {
+  const dtask_t *tasks = state->config.tasks;
+  set_foreach(set,
+              set = dtask_set_or(set, tasks[n].all_dependents));
+  state->select.deferred = set;
+}
+
+#ifdef DTASK_PROFILE
+void dtask_profile_print(const dtask_state_t *state, const char *const *names, unsigned int n) {
+  const dtask_profile_t *p = state->config.profile;
+  bool printed[n];
+  for(unsigned int i = 0; i < n; i++) printed[i] = false;
+  printf("%-24s %10s %10s %14s %10s %10s\n",
+         "task", "calls", "successes", "total", "mean", "max");
+
+  // selection sort, n is small
+  for(unsigned int k = 0; k < n; k++) {
+    unsigned int m = n;
+    for(unsigned int i = 0; i < n; i++) {
+      if(!printed[i] && (m == n || p[i].total > p[m].total)) m = i;
+    }
+    printed[m] = true;
+    if(!p[m].calls) continue;
+    printf("%-24s %10lu %10lu %14llu %10llu %10llu\n",
+           names[m], p[m].calls, p[m].successes,
+           p[m].total, p[m].total / p[m].calls, p[m].max);
+  }
+}
+
+void dtask_profile_reset(dtask_state_t *state, unsigned int n) {
+  for(unsigned int i = 0; i < n; i++) {
+    state->config.profile[i] = (dtask_profile_t) {0};
+  }
+}
+#endif
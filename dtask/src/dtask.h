@@ -34,14 +34,45 @@
 
 /*-------------------- ids and sets --------------------*/
 
+// number of words in a set of dtask ids
+// must match the -w option given to generate_task_header.py
+// one word (up to 64 dtasks) is the fastest
+#ifndef DTASK_SET_WORDS
+#define DTASK_SET_WORDS 1
+#endif
+
 // each dtask has a unique id
+#if DTASK_SET_WORDS <= 4
 typedef uint8_t dtask_id_t;
+#else
+typedef uint16_t dtask_id_t;
+#endif
+
+// a word of a set, with the lowest id in the highest bit
+typedef unsigned long long dtask_word_t;
+
+// bits in a word
+#define DTASK_WORD_BITS DTASK_BIT_WIDTH(dtask_word_t)
 
 // sets of dtask ids
-typedef unsigned long long dtask_set_t;
+#if DTASK_SET_WORDS == 1
+typedef dtask_word_t dtask_set_t;
+#else
+typedef struct {
+  dtask_word_t w[DTASK_SET_WORDS];
+} dtask_set_t;
+#endif
 
 // the maximum id that can fit in dtask_set_t
-#define DTASK_MAX_ID (DTASK_BIT_WIDTH(dtask_set_t) - 1)
+#define DTASK_MAX_ID (DTASK_WORD_BITS * DTASK_SET_WORDS - 1)
+
+// convert an id within a word to a single bit
+static inline
+dtask_word_t dtask_word_bit(unsigned int b) {
+  return ((dtask_word_t)1ull << (DTASK_WORD_BITS - 1)) >> b;
+}
+
+#if DTASK_SET_WORDS == 1
 
 // all events with ids in x = (ID1 | ID2 ... | IDn) have succeeded
 // can only be used inside a dtask
@@ -51,12 +82,118 @@ typedef unsigned long long dtask_set_t;
 // can only be used inside a dtask
 #define DTASK_OR(x) (state->events & (x))
 
+// the empty set
+#define DTASK_SET_EMPTY ((dtask_set_t)0)
+
+// singleton set as a constant expression
+#define DTASK_SET_BIT(id) (((dtask_set_t)1ull << DTASK_MAX_ID) >> (id))
+
 // convert an id to a singleton set (one bit)
 static inline
 dtask_set_t dtask_bit(dtask_id_t id) {
-  return ((dtask_set_t)1ull << DTASK_MAX_ID) >> id;
+  return dtask_word_bit(id);
+}
+
+static inline
+dtask_word_t dtask_set_word(dtask_set_t s, unsigned int k) {
+  (void)k;
+  return s;
+}
+
+static inline
+dtask_set_t dtask_set_or(dtask_set_t a, dtask_set_t b) {
+  return a | b;
+}
+
+static inline
+dtask_set_t dtask_set_and(dtask_set_t a, dtask_set_t b) {
+  return a & b;
+}
+
+// a & ~b
+static inline
+dtask_set_t dtask_set_and_not(dtask_set_t a, dtask_set_t b) {
+  return a & ~b;
+}
+
+static inline
+dtask_set_t dtask_set_all(void) {
+  return ~(dtask_set_t)0;
+}
+
+// true if the set is not empty
+static inline
+bool dtask_set_any(dtask_set_t a) {
+  return a != 0;
+}
+
+#else
+
+// all events with ids in x = dtask_set_or(ID1, ...) have succeeded
+// can only be used inside a dtask
+#define DTASK_AND(x) (!dtask_set_any(dtask_set_and_not((x), state->events)))
+
+// any event with an id in x = dtask_set_or(ID1, ...) has succeeded
+// can only be used inside a dtask
+#define DTASK_OR(x) dtask_set_any(dtask_set_and(state->events, (x)))
+
+// the empty set
+#define DTASK_SET_EMPTY ((dtask_set_t) { .w = { 0 } })
+
+// singleton set as a constant expression
+#define DTASK_SET_BIT(id)                                               \
+  ((dtask_set_t) { .w = { [(id) / DTASK_WORD_BITS] =                    \
+        ((dtask_word_t)1ull << (DTASK_WORD_BITS - 1)) >> ((id) % DTASK_WORD_BITS) } })
+
+// convert an id to a singleton set (one bit)
+static inline
+dtask_set_t dtask_bit(dtask_id_t id) {
+  dtask_set_t s = DTASK_SET_EMPTY;
+  s.w[id / DTASK_WORD_BITS] = dtask_word_bit(id % DTASK_WORD_BITS);
+  return s;
+}
+
+static inline
+dtask_word_t dtask_set_word(dtask_set_t s, unsigned int k) {
+  return s.w[k];
+}
+
+static inline
+dtask_set_t dtask_set_or(dtask_set_t a, dtask_set_t b) {
+  for(unsigned int k = 0; k < DTASK_SET_WORDS; k++) a.w[k] |= b.w[k];
+  return a;
+}
+
+static inline
+dtask_set_t dtask_set_and(dtask_set_t a, dtask_set_t b) {
+  for(unsigned int k = 0; k < DTASK_SET_WORDS; k++) a.w[k] &= b.w[k];
+  return a;
+}
+
+// a & ~b
+static inline
+dtask_set_t dtask_set_and_not(dtask_set_t a, dtask_set_t b) {
+  for(unsigned int k = 0; k < DTASK_SET_WORDS; k++) a.w[k] &= ~b.w[k];
+  return a;
+}
+
+static inline
+dtask_set_t dtask_set_all(void) {
+  dtask_set_t s;
+  for(unsigned int k = 0; k < DTASK_SET_WORDS; k++) s.w[k] = ~(dtask_word_t)0;
+  return s;
+}
+
+// true if the set is not empty
+static inline
+bool dtask_set_any(dtask_set_t a) {
+  dtask_word_t x = 0;
+  for(unsigned int k = 0; k < DTASK_SET_WORDS; k++) x |= a.w[k];
+  return x != 0;
 }
 
+#endif
+
 /*-------------------- state and config --------------------*/
 
 typedef struct dtask_state dtask_state_t;
@@ -64,6 +201,16 @@ typedef struct dtask dtask_t;
 typedef struct dtask_config dtask_config_t;
 typedef struct dtask_select dtask_select_t;
 
+#ifdef DTASK_PROFILE
+// per dtask counters, only with DTASK_PROFILE defined
+typedef struct dtask_profile
+{
+  unsigned long calls, successes;
+  // time spent in DTASK_PROFILE_TIME() units
+  unsigned long long total, max;
+} dtask_profile_t;
+#endif
+
 // describes a dtask and its relations
 // a static const dtask table will be generated that can be stored in ROM
 struct dtask
@@ -108,6 +255,10 @@ struct dtask_config
 #endif
   // graph state id
   const unsigned int id;
+#ifdef DTASK_PROFILE
+  // a counter for each dtask
+  dtask_profile_t *profile;
+#endif
 };
 
 // dtask selection state
@@ -116,7 +267,9 @@ struct dtask_select
   dtask_set_t
     enabled,  // explicitly enabled
     disabled, // explicitly disabled
-    selected; // dtask will only run if selected
+    selected, // dtask will only run if selected
+    deferred, // dtask only runs from dtask_run_deferred()
+    pending;  // deferred dtasks scheduled since the last dtask_run_deferred()
   bool dirty; // selection needs to be updated
 };
 
@@ -130,6 +283,12 @@ struct dtask_state
 // update state, running dtasks in the initial set
 dtask_set_t dtask_run(dtask_state_t *state, dtask_set_t initial);
 
+// run the pending deferred dtasks once, with events from the runs since the last call
+dtask_set_t dtask_run_deferred(dtask_state_t *state, dtask_set_t events);
+
+// defer dtasks in the set and their dependents, or none if empty
+void dtask_defer(dtask_state_t *state, dtask_set_t set);
+
 // request to enable dtasks in the set
 void dtask_enable(dtask_state_t *state, dtask_set_t set);
 
@@ -184,10 +343,18 @@ typedef group_name##_state_t dref_t;
 #endif
 
 // convenient macros to create config/state with required const static members
+#ifdef DTASK_PROFILE
+#define DTASK_PROFILE_COUNTERS(name) , (dtask_profile_t [DTASK_LENGTH(name)]) {{0}}
+#else
+#define DTASK_PROFILE_COUNTERS(name)
+#endif
+
 #ifndef NO_CLZ
-#define DTASK_CONFIG(name, parent, id) {(name), (dtask_state_t *)(parent), (id)}
+#define DTASK_CONFIG(name, parent, id) \
+  {(name), (dtask_state_t *)(parent), (id) DTASK_PROFILE_COUNTERS(name)}
 #else
-#define DTASK_CONFIG(name, parent, id) {(name), (dtask_state_t *)(parent), name##_run, (id)}
+#define DTASK_CONFIG(name, parent, id) \
+  {(name), (dtask_state_t *)(parent), name##_run, (id) DTASK_PROFILE_COUNTERS(name)}
 #endif
 
 #define DTASK_STATE(name, parent, id) {{ .config = DTASK_CONFIG(name, parent, id) }}
@@ -210,4 +377,54 @@ typedef group_name##_state_t dref_t;
 // default function for enable/disable
 void __dtask_noop(dtask_state_t *state);
 
+/*-------------------- profiling --------------------*/
+
+// define DTASK_PROFILE to count calls, successes, and time for each dtask
+// time is measured with DTASK_PROFILE_TIME(), nanoseconds from POSIX clock_gettime() by default,
+// which can be defined to read a cycle counter instead
+
+#ifdef DTASK_PROFILE
+
+#ifndef DTASK_PROFILE_TIME
+#include <time.h>
+
+static inline
+unsigned long long dtask_profile_time(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+#define DTASK_PROFILE_TIME() dtask_profile_time()
+#endif
+
+static inline
+bool dtask_profile_call(dtask_state_t *state, unsigned int id, bool (*func)(dtask_state_t *state)) {
+  dtask_profile_t *p = &state->config.profile[id];
+  unsigned long long start = DTASK_PROFILE_TIME();
+  bool success = func(state);
+  unsigned long long t = DTASK_PROFILE_TIME() - start;
+  p->calls++;
+  if(success) p->successes++;
+  p->total += t;
+  if(t > p->max) p->max = t;
+  return success;
+}
+
+// call a dtask function, counting it
+#define DTASK_CALL(state, id, func) dtask_profile_call((state), (id), (func))
+
+// print the counters of the n dtasks in state, most time first
+void dtask_profile_print(const dtask_state_t *state, const char *const *names, unsigned int n);
+
+// clear the counters of the n dtasks in state
+void dtask_profile_reset(dtask_state_t *state, unsigned int n);
+
+#else
+
+// call a dtask function
+#define DTASK_CALL(state, id, func) (func)(state)
+
+#endif
+
 #endif
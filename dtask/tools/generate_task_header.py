@@ -143,11 +143,30 @@ def show_set(s):
     return ' | '.join(
         map(lambda x: x.upper(), s)) if s else "0"
 
-
 # id to bit set conversion
 def dtask_bit(id):
     return (1 << (options.bits - 1)) >> id
 
+# words of the set of task names, using ids
+def set_words(s, ids):
+    words = [0] * options.words
+    for task in s:
+        id = ids[task]
+        words[id // options.bits] |= dtask_bit(id % options.bits)
+    return words
+
+# generate a multi-word set initializer
+def show_set_words(s, ids):
+    return '{{ .w = {{ {} }} }}'.format(
+        ', '.join(map(lambda w: '0x{:x}ull'.format(w), set_words(s, ids))))
+
+# generate a set initializer, symbolic when one word
+def show_table_set(s, ids):
+    if options.words == 1:
+        return show_set(s)
+    else:
+        return show_set_words(s, ids)
+
 # generate a function name from the task name
 def func_name(task_name, type, present):
     if present:
@@ -177,6 +196,10 @@ def generate_header():
     tasks = order_tasks(tasks)
     ids = {}
     id = 0
+    if len(tasks) > options.bits * options.words:
+        raise Exception('{} tasks in {}, but dtask sets only hold {} ({} x {} bits), see -w'
+                        .format(len(tasks), name, options.bits * options.words,
+                                options.words, options.bits))
 
     # preamble
     with open(header, 'w') as f:
@@ -185,11 +208,18 @@ def generate_header():
 
 #include "dtask.h"
 
-'''.format(name=name.upper()))
+#if DTASK_SET_WORDS != {words}
+#error "generated for DTASK_SET_WORDS={words}"
+#endif
+
+'''.format(name=name.upper(), words=options.words))
 
         # define id macros
         for (task, _) in tasks:
-            f.write('#define {} 0x{:x}ull\n'.format(task.upper(), dtask_bit(id)))
+            if options.words == 1:
+                f.write('#define {} 0x{:x}ull\n'.format(task.upper(), dtask_bit(id)))
+            else:
+                f.write('#define {} DTASK_SET_BIT({:d})\n'.format(task.upper(), id))
             f.write('#define {}_ID {:d}\n'.format(task.upper(), id))
             ids[task] = id
             id = id + 1
@@ -201,14 +231,24 @@ def generate_header():
             f.write('  "{}", \\\n'.format(task))
         f.write('}\n')
 
+        # apply a macro to each task name, in the same order
+        f.write('\n#define {}_FOREACH_TASK(X) \\\n'.format(name.upper()))
+        for (task, _) in tasks:
+            f.write('  X({}) \\\n'.format(task))
+        f.write('\n')
+
         # initial tasks, can only be run when flagged as initial tasks
         initial = set()
         for (task, dict) in tasks:
             if not dict['deps']:
                 initial.add(task)
 
-        f.write('\n#define {}_INITIAL ({})\n\n'.format(name.upper(),
-                                                       show_set(initial)))
+        if options.words == 1:
+            f.write('\n#define {}_INITIAL ({})\n\n'.format(name.upper(),
+                                                           show_set(initial)))
+        else:
+            f.write('\n#define {}_INITIAL ((dtask_set_t) {})\n\n'.format(name.upper(),
+                                                                         show_set_words(initial, ids)))
 
         # declare state type
         f.write('typedef struct {}_state {{\n'.format(name))
@@ -245,50 +285,122 @@ static const dtask_t {}[{}] = {{
     }},\n'''.format(task=task,
                     en=func_name(task, 'enable', dict['en']),
                     dis=func_name(task, 'disable', dict['dis']),
-                    depnts=show_set(dict['depnts']),
-                    all_deps=show_set(dict['all_deps']),
-                    all_depnts=show_set(dict['all_depnts'])))
+                    depnts=show_table_set(dict['depnts'], ids),
+                    all_deps=show_table_set(dict['all_deps'], ids),
+                    all_depnts=show_table_set(dict['all_depnts'], ids)))
         f.write(' };\n')
 
         # define the NO_CLZ run function (compare to dtask_run)
         f.write('\n#ifdef NO_CLZ\n')
-
-        # prologue
         f.write('''
 #pragma GCC diagnostic ignored "-Wunused-function"
-static dtask_set_t {name}_run(dtask_state_t *state, dtask_set_t initial) {{
-  const dtask_set_t selected = state->select.selected;
+static dtask_set_t {name}_run(dtask_state_t *state, dtask_set_t initial) {{'''.format(name=name))
+        write_run_body(f, tasks, ids, 'initial')
+        f.write('''
+#endif
+''')
+
+        # define a run function specialized for each entry point
+        for task in options.entries:
+            if not task in ids:
+                raise Exception('unknown entry task: {}'.format(task))
+        entries = [task for (task, dict) in tasks
+                   if task in initial or task in options.entries]
+        if entries:
+            f.write('''
+// specialized dtask_run(state, ENTRY) for each entry point,
+// only running the tasks reachable from it, without the dtask table
+// define {upname}_RUN_FUNCTIONS before including this header
+// in the file that defines the tasks, so that they can be inlined
+'''.format(upname=name.upper()))
+            for task in entries:
+                f.write('dtask_set_t {}_run_{}(dtask_state_t *state);\n'.format(name, task))
+            f.write('\n#ifdef {}_RUN_FUNCTIONS\n'.format(name.upper()))
+            for task in entries:
+                f.write('''
+dtask_set_t {name}_run_{task}(dtask_state_t *state) {{
+  dtask_select(state);'''.format(name=name, task=task))
+                write_run_body(f, reachable(tasks, task), ids, task.upper())
+            f.write('''
+#endif
+''')
+        f.write('''
+#endif
+''')
+
+# tasks that can run after the entry task, in order
+def reachable(tasks, entry):
+    found = set([entry])
+    for (task, dict) in tasks:
+        if task in found:
+            found |= dict['depnts']
+    return [(task, dict) for (task, dict) in tasks if task in found]
+
+# write the body of a run function that runs the tasks in order,
+# starting with the initial set expression (compare to dtask_run)
+def write_run_body(f, tasks, ids, initial):
+
+    # prologue
+    if options.words == 1:
+        f.write('''
+  const dtask_set_t runnable = state->select.selected & ~state->select.deferred;
   dtask_set_t
-    scheduled = initial & selected;
+    scheduled = {initial} & runnable,
+    held = {initial};
   state->events = 0;
-'''.format(name=name))
-
-        # dispatch code
-        for (task, dict) in tasks:
+'''.format(initial=initial))
+    else:
+        f.write('''
+  const dtask_set_t runnable = dtask_set_and_not(state->select.selected, state->select.deferred);
+  dtask_set_t
+    scheduled = dtask_set_and({initial}, runnable),
+    held = {initial};
+  state->events = DTASK_SET_EMPTY;
+'''.format(initial=initial))
+
+    # dispatch code
+    for (task, dict) in tasks:
+        if options.words == 1:
             f.write('''
-  if(({uptask} & scheduled) && __dtask_{task}(state)) {{
+  if(({uptask} & scheduled) && DTASK_CALL(state, {id}, __dtask_{task})) {{
     state->events |= {uptask};'''.format(task=task,
-                                         uptask=task.upper()))
+                                     uptask=task.upper(),
+                                     id=ids[task]))
             if dict['depnts']:
                 f.write('''
-    scheduled |= ({depnts}) & selected;'''
+    scheduled |= ({depnts}) & runnable;
+    held |= {depnts};'''
                         .format(depnts=show_set(dict['depnts'])))
-
+        else:
+            k = ids[task] // options.bits
+            bit = dtask_bit(ids[task] % options.bits)
             f.write('''
+  if((scheduled.w[{k}] & 0x{bit:x}ull) && DTASK_CALL(state, {id}, __dtask_{task})) {{
+    state->events.w[{k}] |= 0x{bit:x}ull;'''.format(task=task, k=k, bit=bit, id=ids[task]))
+            for (j, w) in enumerate(set_words(dict['depnts'], ids)):
+                if w:
+                    f.write('''
+    scheduled.w[{j}] |= 0x{w:x}ull & runnable.w[{j}];
+    held.w[{j}] |= 0x{w:x}ull;'''.format(j=j, w=w))
+
+        f.write('''
   }
 ''')
 
-        # epilogue
+    # epilogue, deferred tasks that were scheduled are pending
+    if options.words == 1:
         f.write('''
+  state->select.pending |= held & state->select.selected & ~runnable;''')
+    else:
+        f.write('''
+  state->select.pending =
+    dtask_set_or(state->select.pending,
+                 dtask_set_and_not(dtask_set_and(held, state->select.selected), runnable));''')
+    f.write('''
   return state->events;
 }
 ''')
 
-        f.write('''
-#endif
-#endif
-''')
-
 
 def main():
 
@@ -304,7 +416,10 @@ def main():
                         action='append', help='include dir', default=[])
     parser.add_argument('-D', dest='macros', metavar='MACRO',
                         action='append', help='define macro', default=[])
-    parser.add_argument('-b', dest='bits', type=int, default=32, help='bit width of dtask_set_t')
+    parser.add_argument('-b', dest='bits', type=int, default=64, help='bit width of a dtask_set_t word')
+    parser.add_argument('-e', dest='entries', metavar='TASK',
+                        action='append', help='also generate a run function for this task', default=[])
+    parser.add_argument('-w', dest='words', type=int, default=1, help='words in dtask_set_t (DTASK_SET_WORDS)')
     options, _ = parser.parse_known_args()
 
     # generate the header
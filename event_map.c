@@ -0,0 +1,543 @@
+/* Copyright 2020-2021 Dustin DeWeese
+   This file is part of MidiPush.
+
+    MidiPush is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    MidiPush is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with MidiPush.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "types.h"
+#include "startle/types.h"
+#include "startle/macros.h"
+#include "startle/support.h"
+#include "startle/test.h"
+#include "startle/map.h"
+
+#include "event_map.h"
+
+// Recorded events, packed into 8 bytes each and kept sorted by channel, then beat (CSR layout).
+// Events for key k = EVENT_KEY(channel, beat) are event[start[k]] ... event[start[k + 1] - 1],
+// so looking up a beat costs O(1) plus the number of events at that beat on that channel,
+// and each channel's events are contiguous.
+// Inserts are held in a small buffer, and merged into the buckets in one pass by event_map_merge(),
+// so that recording doesn't move the events after them and every offset for each message.
+// Lookups don't see them until then, which is at most until the next event_map_maintain().
+// Deleted events are marked, and swept out later by event_map_compact() from event_map_maintain().
+// Storage grows by relocating to twice the size, also from event_map_maintain(),
+// which should be called outside of the tick, so that inserts rarely find it full
+// and the tick never moves more than a bucket.
+// Maps are per scene and shared until written, so storage comes from the heap rather than
+// a static region. To keep allocation out of the tick, event_map_maintain() also keeps
+// a spare map as large as the one maintained, which event_map_new() and event_map_clone() take,
+// and a released map becomes the spare if there isn't one.
+
+#if INTERFACE
+#ifndef EVENT_MAP_MIN_SIZE
+#define EVENT_MAP_MIN_SIZE (1 << 12)
+#endif
+
+// hard limit on the number of events, set lower for small boards
+#ifndef EVENT_MAP_MAX_SIZE
+#define EVENT_MAP_MAX_SIZE (1 << 20)
+#endif
+
+// inserts held before merging, a full buffer is merged by the insert that finds it full
+#ifndef EVENT_MAP_PENDING
+#define EVENT_MAP_PENDING 256
+#endif
+
+#define EVENT_DELETED 0x01
+
+#define EVENT_MAP_KEYS (16 * BEATS)
+#define EVENT_KEY(channel, beat) ((channel) * BEATS + (beat))
+
+typedef struct event {
+  uint16_t beat;
+  uint8_t flags;
+  uint8_t msg[3];
+  uint8_t unused[2];
+} event_t;
+
+typedef struct event_map {
+  uint32_t start[EVENT_MAP_KEYS + 1];
+  uint32_t deleted; // number of events marked EVENT_DELETED
+  uint32_t size, max_size;
+  uint32_t grown, dropped; // times relocated, and inserts that didn't fit
+  uint32_t refs; // maps allocated by event_map_new() can be shared
+  uint32_t pending; // inserts not yet merged
+  event_t pending_event[EVENT_MAP_PENDING];
+  event_t *event;
+} event_map_t;
+#endif
+
+// grow when this full
+#define EVENT_MAP_GROW_AT(size) ((size) / 4 * 3)
+
+// events in the buckets
+static
+uint32_t stored(const event_map_t *m) {
+  return m->start[EVENT_MAP_KEYS];
+}
+
+void event_map_init(event_map_t *m, size_t max_size) {
+  free(m->event);
+  memset(m, 0, sizeof(*m));
+  m->max_size = max_size;
+}
+
+static event_map_t *spare;
+
+// an empty map, with storage already reserved if it's the spare
+event_map_t *event_map_new(size_t max_size) {
+  event_map_t *m = spare;
+  if(m && m->max_size == max_size) {
+    spare = NULL;
+    event_map_clear(m);
+    m->grown = 0;
+    m->dropped = 0;
+  } else {
+    m = calloc(1, sizeof(event_map_t));
+    if(!m) return NULL;
+    m->max_size = max_size;
+  }
+  m->refs = 1;
+  return m;
+}
+
+void event_map_release(event_map_t *m) {
+  if(m && !--m->refs) {
+    if(!spare) {
+      spare = m;
+      return;
+    }
+    free(m->event);
+    free(m);
+  }
+}
+
+// a new map with the same events, or NULL
+event_map_t *event_map_clone(const event_map_t *src) {
+  event_map_t *m = event_map_new(src->max_size);
+  if(!m) return NULL;
+  if(!event_map_reserve(m, max(event_map_count(src), 1))) {
+    event_map_release(m);
+    return NULL;
+  }
+  memcpy(m->start, src->start, sizeof(m->start));
+  memcpy(m->event, src->event, stored(src) * sizeof(event_t));
+  memcpy(m->pending_event, src->pending_event, src->pending * sizeof(event_t));
+  m->pending = src->pending;
+  m->deleted = src->deleted;
+  return m;
+}
+
+// make room for n events, returns false if n is over the limit or allocation fails
+bool event_map_reserve(event_map_t *m, size_t n) {
+  if(n <= m->size) return true;
+  if(n > m->max_size) return false;
+  size_t size = max(m->size, EVENT_MAP_MIN_SIZE);
+  while(size < n) size *= 2;
+  size = min(size, m->max_size);
+  event_t *event = realloc(m->event, size * sizeof(event_t));
+  if(!event) return false;
+  if(m->size) m->grown++;
+  m->event = event;
+  m->size = size;
+  return true;
+}
+
+// grow ahead of inserts
+static
+bool grow(event_map_t *m) {
+  if(event_map_count(m) < EVENT_MAP_GROW_AT(m->size) || m->size >= m->max_size) return false;
+  return event_map_reserve(m, m->size * 2);
+}
+
+// make sure the next copy of the map won't allocate
+static
+void prepare_spare(const event_map_t *m) {
+  if(spare && spare->max_size != m->max_size) {
+    free(spare->event);
+    free(spare);
+    spare = NULL;
+  }
+  if(!spare) spare = event_map_new(m->max_size);
+  if(spare) event_map_reserve(spare, m->size);
+}
+
+// merge inserts, remove deleted events, then grow ahead of more, returns true if the storage moved
+// this doesn't change the contents, so it's fine if the map is shared
+bool event_map_maintain(event_map_t *m) {
+  event_map_merge(m);
+  if(m->deleted) event_map_compact(m, 0, EVENT_MAP_KEYS);
+  bool moved = grow(m);
+  prepare_spare(m);
+  return moved;
+}
+
+// percent of the storage used
+unsigned int event_map_fill(const event_map_t *m) {
+  return m->size ? event_map_count(m) * 100 / m->size : 100;
+}
+
+// including inserts that aren't merged yet
+size_t event_map_count(const event_map_t *m) {
+  return m->start[EVENT_MAP_KEYS] + m->pending;
+}
+
+void event_map_clear(event_map_t *m) {
+  memset(m->start, 0, sizeof(m->start));
+  m->deleted = 0;
+  m->pending = 0;
+}
+
+static
+unsigned int event_key(const event_t *e) {
+  return EVENT_KEY(e->msg[0] & 0x0f, e->beat);
+}
+
+// the channel's events at the beat, sets *n to the number of events
+event_t *event_map_at(event_map_t *m, unsigned int channel, unsigned int beat, size_t *n) {
+  unsigned int k = EVENT_KEY(channel, beat);
+  *n = m->start[k + 1] - m->start[k];
+  return &m->event[m->start[k]];
+}
+
+// all of the channel's events in beat order, sets *n to the number of events
+event_t *event_map_channel(event_map_t *m, unsigned int channel, size_t *n) {
+  unsigned int k = EVENT_KEY(channel, 0);
+  *n = m->start[k + BEATS] - m->start[k];
+  return &m->event[m->start[k]];
+}
+
+// add an event to the end of its bucket, once merged
+bool event_map_insert(event_map_t *m, event_t e) {
+  if(e.beat >= BEATS) return false;
+  if(event_map_count(m) >= m->size) {
+    m->dropped++;
+    return false;
+  }
+  if(m->pending >= EVENT_MAP_PENDING) event_map_merge(m);
+  m->pending_event[m->pending++] = e;
+  return true;
+}
+
+// move pending inserts into their buckets, O(n + EVENT_MAP_KEYS) for all of them
+void event_map_merge(event_map_t *m) {
+  uint32_t n = m->pending;
+  if(!n) return;
+  event_t *p = m->pending_event;
+
+  // stable insertion sort by key, there are only a few
+  RANGEUP(i, 1, n) {
+    event_t e = p[i];
+    unsigned int k = event_key(&e);
+    uint32_t j = i;
+    while(j && event_key(&p[j - 1]) > k) {
+      p[j] = p[j - 1];
+      j--;
+    }
+    p[j] = e;
+  }
+
+  // from the end, open a gap after each one's bucket for it and the ones before it
+  // keys after each one's bucket, up to the last one's, move up by that many
+  uint32_t hi = stored(m);
+  unsigned int top = EVENT_MAP_KEYS;
+  COUNTDOWN(j, n) {
+    unsigned int k = event_key(&p[j]);
+    uint32_t lo = k == top ? hi : m->start[k + 1]; // offsets after top have moved
+    memmove(&m->event[lo + j + 1], &m->event[lo], (hi - lo) * sizeof(m->event[0]));
+    m->event[lo + j] = p[j];
+    RANGEUP(i, k + 1, top + 1) {
+      m->start[i] += j + 1;
+    }
+    top = k;
+    hi = lo;
+  }
+  m->pending = 0;
+}
+
+// remove all of the channel's events at once, returns the number removed
+size_t event_map_clear_channel(event_map_t *m, unsigned int channel) {
+  event_map_merge(m);
+  size_t n;
+  const event_t *events = event_map_channel(m, channel, &n);
+  if(!n) return 0;
+  COUNTUP(i, n) {
+    if(events[i].flags & EVENT_DELETED) m->deleted--;
+  }
+  unsigned int k = EVENT_KEY(channel, 0);
+  uint32_t pos = m->start[k + BEATS];
+  memmove(&m->event[pos - n], &m->event[pos], (stored(m) - pos) * sizeof(m->event[0]));
+  RANGEUP(i, k + 1, k + BEATS) {
+    m->start[i] = m->start[k];
+  }
+  RANGEUP(i, k + BEATS, EVENT_MAP_KEYS + 1) {
+    m->start[i] -= n;
+  }
+  return n;
+}
+
+// mark an event to be removed by event_map_compact()
+void event_map_delete(event_map_t *m, event_t *e) {
+  if(!(e->flags & EVENT_DELETED)) {
+    e->flags |= EVENT_DELETED;
+    m->deleted++;
+  }
+}
+
+// remove deleted events in n keys starting at the given key, without wrapping
+// returns the number of events removed
+size_t event_map_compact(event_map_t *m, unsigned int key, unsigned int n) {
+  unsigned int end = min(EVENT_MAP_KEYS, key + n);
+  uint32_t r = 0;
+  RANGEUP(b, key, end) {
+    uint32_t stop = m->start[b + 1];
+    m->start[b] -= r;
+    RANGEUP(i, m->start[b] + r, stop) {
+      if(m->event[i].flags & EVENT_DELETED) {
+        r++;
+      } else if(r) {
+        m->event[i - r] = m->event[i];
+      }
+    }
+  }
+  if(r) {
+    uint32_t pos = m->start[end];
+    memmove(&m->event[pos - r], &m->event[pos], (stored(m) - pos) * sizeof(m->event[0]));
+    RANGEUP(b, end, EVENT_MAP_KEYS + 1) {
+      m->start[b] -= r;
+    }
+    m->deleted -= r;
+  }
+  return r;
+}
+
+// fill from events in any order, O(n + EVENT_MAP_KEYS)
+// returns false if any are invalid
+bool event_map_build(event_map_t *m, const event_t *events, size_t n) {
+  event_map_clear(m);
+  if(!event_map_reserve(m, n)) return false;
+  COUNTUP(i, n) {
+    if(events[i].beat >= BEATS) return false;
+    m->start[event_key(&events[i]) + 1]++;
+  }
+  RANGEUP(k, 1, EVENT_MAP_KEYS + 1) {
+    m->start[k] += m->start[k - 1];
+  }
+
+  // place each event at the end of its bucket, keeping the order within a bucket
+  static uint32_t fill[EVENT_MAP_KEYS];
+  memcpy(fill, m->start, sizeof(fill));
+  COUNTUP(i, n) {
+    event_t e = events[i];
+    e.flags &= ~EVENT_DELETED;
+    m->event[fill[event_key(&e)]++] = e;
+  }
+  return true;
+}
+
+// rebuild the offsets after loading n events into storage reserved for them,
+// which must already be sorted by key, returns false if they aren't
+bool event_map_index(event_map_t *m, size_t n) {
+  if(n > m->size) return false;
+  unsigned int key = 0;
+  m->start[0] = 0;
+  m->deleted = 0;
+  m->pending = 0;
+  COUNTUP(i, n) {
+    const event_t *e = &m->event[i];
+    unsigned int k = event_key(e);
+    if(k < key || e->beat >= BEATS) return false;
+    while(key < k) m->start[++key] = i;
+    if(e->flags & EVENT_DELETED) m->deleted++;
+  }
+  while(key < EVENT_MAP_KEYS) m->start[++key] = n;
+  return true;
+}
+
+TEST(event_map) {
+  static event_map_t m;
+  event_map_init(&m, EVENT_MAP_MAX_SIZE);
+  event_t events[] = {
+    { .beat = 3, .msg = {0x90, 30} },
+    { .beat = 1, .msg = {0x90, 10} },
+    { .beat = 3, .msg = {0x90, 31} }
+  };
+  if(!event_map_build(&m, events, LENGTH(events))) return -1;
+  size_t n;
+  const event_t *e = event_map_at(&m, 0, 3, &n);
+  if(n != 2 || e[0].msg[1] != 30 || e[1].msg[1] != 31) return -2;
+  event_map_at(&m, 0, 2, &n);
+  if(n != 0) return -3;
+  event_map_insert(&m, (event_t) { .beat = 2, .msg = {0x90, 20} });
+  event_map_insert(&m, (event_t) { .beat = 3, .msg = {0x90, 32} });
+  event_map_at(&m, 0, 2, &n);
+  if(n != 0 || event_map_count(&m) != 5) return -18;
+  event_map_merge(&m);
+  e = event_map_at(&m, 0, 2, &n);
+  if(n != 1 || e[0].msg[1] != 20) return -4;
+  event_map_delete(&m, event_map_at(&m, 0, 3, &n));
+  event_map_delete(&m, event_map_at(&m, 0, 1, &n));
+  if(m.deleted != 2) return -5;
+  if(event_map_compact(&m, 2, 1) != 0) return -6;
+  if(event_map_compact(&m, 0, 3) != 1) return -7;
+  e = event_map_at(&m, 0, 3, &n);
+  if(n != 3 || !(e[0].flags & EVENT_DELETED)) return -8;
+  if(event_map_compact(&m, 3, BEATS) != 1) return -9;
+  e = event_map_at(&m, 0, 3, &n);
+  if(n != 2 || e[0].msg[1] != 31 || e[1].msg[1] != 32) return -10;
+  if(event_map_count(&m) != 3 || m.deleted != 0) return -11;
+  if(!event_map_index(&m, event_map_count(&m))) return -12;
+  e = event_map_at(&m, 0, 2, &n);
+  if(n != 1 || e[0].msg[1] != 20) return -13;
+
+  // channels are kept apart
+  event_map_insert(&m, (event_t) { .beat = 1, .msg = {0x92, 40} });
+  event_map_insert(&m, (event_t) { .beat = 0, .msg = {0x92, 41} });
+  event_map_insert(&m, (event_t) { .beat = 3, .msg = {0x91, 42} });
+  event_map_merge(&m);
+  event_t *c = event_map_channel(&m, 2, &n);
+  if(n != 2 || c[0].msg[1] != 41 || c[1].msg[1] != 40) return -14;
+  event_map_delete(&m, &c[1]);
+  if(event_map_clear_channel(&m, 2) != 2 || m.deleted != 0) return -15;
+  event_map_at(&m, 2, 1, &n);
+  if(n != 0) return -16;
+  e = event_map_at(&m, 1, 3, &n);
+  if(n != 1 || e[0].msg[1] != 42 || event_map_count(&m) != 4) return -17;
+  return 0;
+}
+
+// merging many inserts in any order gives the same buckets as building from them
+TEST(event_map_merge) {
+  static event_map_t m, b;
+  static event_t events[EVENT_MAP_PENDING * 3 + 5];
+  event_map_init(&m, EVENT_MAP_MAX_SIZE);
+  event_map_init(&b, EVENT_MAP_MAX_SIZE);
+  event_map_reserve(&m, 1);
+  srand(3);
+  FOREACH(i, events) {
+    events[i] = (event_t) { .beat = rand() % 8 * 100, .msg = {0x90 | rand() % 4, i & 0x7f, i >> 7} };
+    event_map_insert(&m, events[i]);
+  }
+  if(m.pending != 5) return -1;
+  event_map_merge(&m);
+  event_map_build(&b, events, LENGTH(events));
+  int ret = 0;
+  if(m.pending || event_map_count(&m) != LENGTH(events)) ret = -2;
+  else if(memcmp(m.start, b.start, sizeof(m.start))) ret = -3;
+  else if(memcmp(m.event, b.event, LENGTH(events) * sizeof(event_t))) ret = -4;
+  event_map_init(&m, 0);
+  event_map_init(&b, 0);
+  return ret;
+}
+
+// copying a maintained map takes the spare instead of allocating
+TEST(event_map_spare) {
+  event_map_t *m = event_map_new(EVENT_MAP_MAX_SIZE);
+  if(!m || !event_map_reserve(m, EVENT_MAP_MIN_SIZE * 2)) return -1;
+  event_map_insert(m, (event_t) { .beat = 5, .msg = {0x90, 50} });
+  event_map_maintain(m);
+  event_map_t *s = spare;
+  if(!s || s->size < m->size) return -2;
+  event_map_t *c = event_map_clone(m);
+  int ret = 0;
+  if(c != s || spare) ret = -3;
+  else if(event_map_count(c) != 1 || c->size != m->size) ret = -4;
+  event_map_release(c);
+  if(!ret && spare != c) ret = -5;
+  event_map_release(m);
+  return ret;
+}
+
+TEST(event_map_grow) {
+  static event_map_t m;
+  event_map_init(&m, EVENT_MAP_MIN_SIZE * 2);
+  event_map_reserve(&m, 1);
+  COUNTUP(i, EVENT_MAP_MIN_SIZE * 3) {
+    event_map_insert(&m, (event_t) { .beat = i % BEATS, .msg = {0x90, i & 0x7f} });
+    event_map_maintain(&m);
+  }
+  printf("size = %u, fill = %u%%, grown = %u, dropped = %u\n",
+         m.size, event_map_fill(&m), m.grown, m.dropped);
+  if(m.size != EVENT_MAP_MIN_SIZE * 2) return -1;
+  if(m.grown != 1) return -2;
+  if(event_map_count(&m) != EVENT_MAP_MIN_SIZE * 2) return -3;
+  if(m.dropped != EVENT_MAP_MIN_SIZE) return -4;
+  size_t n;
+  event_t *e = event_map_at(&m, 0, 1, &n);
+  if(!n) return -5;
+
+  // deleted events are removed by maintenance, not by inserts
+  event_map_delete(&m, e);
+  if(event_map_insert(&m, (event_t) { .beat = 2, .msg = {0x90, 60} })) return -6;
+  event_map_maintain(&m);
+  if(m.deleted || event_map_count(&m) != EVENT_MAP_MIN_SIZE * 2 - 1) return -7;
+  event_map_init(&m, 0);
+  return 0;
+}
+
+// compare per-tick lookup cost on every channel against walking a map of pairs
+TEST(event_map_bench) {
+  static event_map_t m;
+  static event_t events[1 << 15];
+  event_map_init(&m, EVENT_MAP_MAX_SIZE);
+  const size_t sizes[] = {1 << 10, 1 << 13, 1 << 15};
+  const int loops = 4;
+  srand(1);
+  FOREACH(k, sizes) {
+    size_t size = sizes[k];
+    map_t pairs = alloc_map(size);
+    COUNTUP(i, size) {
+      event_t e = { .beat = rand() % BEATS, .msg = {0x90 | rand() % 16, rand() & 0x7f} };
+      map_insert(pairs, PAIR(e.beat, e.msg[1]));
+      events[i] = e;
+    }
+    event_map_build(&m, events, size);
+
+    uintptr_t sum_map = 0, sum_events = 0;
+    long long t0 = time_ns();
+    LOOP(loops) {
+      COUNTUP(beat, BEATS) {
+        map_iterator it = map_iterator_begin(pairs, beat);
+        pair_t *p = map_find_iter(&it);
+        while(p) {
+          sum_map += p->second;
+          p = map_next(&it, p);
+        }
+      }
+    }
+    long long t1 = time_ns();
+    LOOP(loops) {
+      COUNTUP(beat, BEATS) {
+        COUNTUP(c, 16) {
+          size_t n;
+          const event_t *e = event_map_at(&m, c, beat, &n);
+          COUNTUP(i, n) sum_events += e[i].msg[1];
+        }
+      }
+    }
+    long long t2 = time_ns();
+    printf("%6d events: map %6lld ns/tick, event map %6lld ns/tick\n", (int)size,
+           (t1 - t0) / (loops * BEATS), (t2 - t1) / (loops * BEATS));
+    free(pairs);
+    if(sum_map != sum_events) return -1;
+  }
+  return 0;
+}
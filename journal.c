@@ -0,0 +1,380 @@
+/* Copyright 2020-2021 Dustin DeWeese
+   This file is part of MidiPush.
+
+    MidiPush is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    MidiPush is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with MidiPush.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "types.h"
+#include "startle/types.h"
+#include "startle/macros.h"
+#include "startle/support.h"
+#include "startle/test.h"
+
+#include "vec128b.h"
+#include "note_grid.h"
+#include "event_map.h"
+#include "scene.h"
+#include "journal.h"
+
+// Undo journal for edits to scenes.
+// Each edit is logged as enough to reverse it: the note bits that changed on a beat,
+// an event that was inserted or deleted, or a snapshot of a whole scene before clearing it.
+// Snapshots share pages and events with the scene, so taking one is cheap.
+// A checkpoint starts each group of edits, and undo/redo move over a group at a time.
+// When full, the oldest groups are dropped. The journal isn't saved.
+
+#if INTERFACE
+#define JOURNAL_SIZE (1 << 13)
+#define JOURNAL_SNAPSHOTS 4
+#endif
+
+#define JOURNAL_MASK (JOURNAL_SIZE - 1)
+
+enum journal_type {
+  JOURNAL_CHECKPOINT = 0,
+  JOURNAL_NOTES,  // notes toggled on a beat
+  JOURNAL_INSERT, // event inserted
+  JOURNAL_DELETE, // event deleted
+  JOURNAL_SCENE,  // scene swapped with a snapshot
+  JOURNAL_SPAN    // a note cleared over a run of beats
+};
+
+typedef struct journal_entry {
+  uint8_t type, scene, channel, slot;
+  uint16_t span, len; // beats in the span, and the loop length it wraps at
+  event_t event; // beat is used for notes and spans too, and msg[1] for the span's note
+  vec128b notes;
+} journal_entry_t;
+
+// tail <= open <= cur <= head, and indices are masked when used
+// [tail, cur) can be undone and [cur, head) can be redone
+// open is the start of the group being written
+static struct {
+  journal_entry_t entry[JOURNAL_SIZE];
+  scene_t snapshot[JOURNAL_SNAPSHOTS];
+  uint32_t tail, open, cur, head;
+  unsigned int snapshots_used;
+  bool pending, discard;
+} journal;
+
+static
+void drop_entry(journal_entry_t *e) {
+  if(e->type == JOURNAL_SCENE) {
+    scene_free(&journal.snapshot[e->slot]);
+    journal.snapshots_used &= ~(1u << e->slot);
+  }
+}
+
+void journal_clear() {
+  while(journal.tail != journal.head) {
+    drop_entry(&journal.entry[journal.tail++ & JOURNAL_MASK]);
+  }
+  journal.open = journal.cur = journal.head;
+  journal.pending = true;
+}
+
+// drop the oldest group, unless it's being written
+static
+bool drop_group() {
+  if(journal.tail == journal.open) return false;
+  do {
+    drop_entry(&journal.entry[journal.tail++ & JOURNAL_MASK]);
+  } while(journal.tail != journal.open &&
+          journal.entry[journal.tail & JOURNAL_MASK].type != JOURNAL_CHECKPOINT);
+  return true;
+}
+
+// the current group doesn't fit, so forget everything until the next checkpoint
+static
+void overflow() {
+  printf("edit too large to undo\n");
+  journal_clear();
+  journal.discard = true;
+}
+
+static
+bool append(journal_entry_t e) {
+  while(journal.head - journal.tail >= JOURNAL_SIZE) {
+    if(!drop_group()) {
+      overflow();
+      return false;
+    }
+  }
+  journal.entry[journal.head++ & JOURNAL_MASK] = e;
+  journal.cur = journal.head;
+  return true;
+}
+
+// prepare to log an edit, forgetting anything that was undone
+static
+bool journal_start() {
+  if(journal.discard) return false;
+  while(journal.head != journal.cur) {
+    drop_entry(&journal.entry[--journal.head & JOURNAL_MASK]);
+  }
+  if(journal.pending) {
+    journal.pending = false;
+    journal.open = journal.head;
+    return append((journal_entry_t) { .type = JOURNAL_CHECKPOINT });
+  }
+  return true;
+}
+
+// start a new group with the next edit
+void journal_checkpoint() {
+  journal.pending = true;
+  journal.discard = false;
+}
+
+static
+uint8_t scene_index(const scene_t *s) {
+  return s - scenes;
+}
+
+static
+void log_notes(scene_t *s, unsigned int channel, unsigned int beat, const vec128b *changed) {
+  if(vec128b_zero(changed) || !journal_start()) return;
+  append((journal_entry_t) {
+      .type = JOURNAL_NOTES,
+      .scene = scene_index(s),
+      .channel = channel,
+      .event = { .beat = beat },
+      .notes = *changed
+    });
+}
+
+static
+void log_event(scene_t *s, uint8_t type, event_t e) {
+  if(!journal_start()) return;
+  e.flags &= ~EVENT_DELETED;
+  append((journal_entry_t) {
+      .type = type,
+      .scene = scene_index(s),
+      .event = e
+    });
+}
+
+// returns false if there's no room for the notes, and then nothing is logged
+bool journal_notes_or(scene_t *s, unsigned int channel, unsigned int beat, const vec128b *notes) {
+  vec128b changed = *notes;
+  vec128b_and_not(&changed, note_grid_get(&s->notes, channel, beat));
+  if(!note_grid_or(&s->notes, channel, beat, notes)) return false;
+  log_notes(s, channel, beat, &changed);
+  return true;
+}
+
+void journal_notes_and_not(scene_t *s, unsigned int channel, unsigned int beat, const vec128b *notes) {
+  vec128b changed = *notes;
+  vec128b_and(&changed, note_grid_get(&s->notes, channel, beat));
+  log_notes(s, channel, beat, &changed);
+  note_grid_and_not(&s->notes, channel, beat, notes);
+}
+
+void journal_span_clear(scene_t *s, unsigned int channel, unsigned int note,
+                        unsigned int first, unsigned int n, unsigned int len) {
+  if(!n) return;
+  note_grid_set_span(&s->notes, channel, note, first, n, len, false);
+  if(!journal_start()) return;
+  append((journal_entry_t) {
+      .type = JOURNAL_SPAN,
+      .scene = scene_index(s),
+      .channel = channel,
+      .span = n,
+      .len = len,
+      .event = { .beat = first, .msg = { 0, note } }
+    });
+}
+
+bool journal_event_insert(scene_t *s, event_t e) {
+  event_map_t *m = scene_events_mut(s);
+  if(!m || !event_map_insert(m, e)) return false;
+  log_event(s, JOURNAL_INSERT, e);
+  return true;
+}
+
+// e must be in the scene's events, from scene_events_mut()
+void journal_event_delete(scene_t *s, event_t *e) {
+  if(e->flags & EVENT_DELETED) return;
+  event_map_delete(s->events, e);
+  log_event(s, JOURNAL_DELETE, *e);
+}
+
+// save the whole scene before replacing or clearing it
+void journal_scene(scene_t *s) {
+  if(!journal_start()) return;
+  while(!(~journal.snapshots_used & ((1u << JOURNAL_SNAPSHOTS) - 1))) {
+    if(!drop_group()) {
+      overflow();
+      return;
+    }
+  }
+  unsigned int slot = __builtin_ctz(~journal.snapshots_used);
+  if(!append((journal_entry_t) {
+        .type = JOURNAL_SCENE,
+        .scene = scene_index(s),
+        .slot = slot
+      })) return;
+  journal.snapshots_used |= 1u << slot;
+  scene_copy(&journal.snapshot[slot], s);
+}
+
+// toggle the notes that changed
+static
+void apply_notes(scene_t *s, const journal_entry_t *e) {
+  vec128b set = e->notes, clear = e->notes;
+  const vec128b *cur = note_grid_get(&s->notes, e->channel, e->event.beat);
+  vec128b_and_not(&set, cur);
+  vec128b_and(&clear, cur);
+  note_grid_or(&s->notes, e->channel, e->event.beat, &set);
+  note_grid_and_not(&s->notes, e->channel, e->event.beat, &clear);
+}
+
+static
+void apply_insert(scene_t *s, event_t e) {
+  event_map_t *m = scene_events_mut(s);
+  if(m) event_map_insert(m, e);
+}
+
+// delete one live event with the same beat and message
+static
+void apply_delete(scene_t *s, event_t e) {
+  event_map_t *m = scene_events_mut(s);
+  if(!m) return;
+  event_map_merge(m);
+  size_t n;
+  event_t *events = event_map_at(m, e.msg[0] & 0x0f, e.beat, &n);
+  COUNTUP(i, n) {
+    if(!(events[i].flags & EVENT_DELETED) &&
+       memcmp(events[i].msg, e.msg, sizeof(e.msg)) == 0) {
+      event_map_delete(m, &events[i]);
+      return;
+    }
+  }
+}
+
+static
+void apply(const journal_entry_t *e, bool undo) {
+  scene_t *s = &scenes[e->scene];
+  switch(e->type) {
+  case JOURNAL_NOTES:
+    apply_notes(s, e);
+    break;
+  case JOURNAL_INSERT:
+  case JOURNAL_DELETE:
+    if(undo == (e->type == JOURNAL_INSERT)) {
+      apply_delete(s, e->event);
+    } else {
+      apply_insert(s, e->event);
+    }
+    break;
+  case JOURNAL_SPAN:
+    note_grid_set_span(&s->notes, e->channel, e->event.msg[1], e->event.beat, e->span, e->len, undo);
+    break;
+  case JOURNAL_SCENE: {
+    scene_t tmp = *s;
+    *s = journal.snapshot[e->slot];
+    journal.snapshot[e->slot] = tmp;
+    break;
+  }
+  }
+}
+
+// reverse the last group of edits, returning false if there isn't one
+bool journal_undo() {
+  if(journal.cur == journal.tail) return false;
+  const journal_entry_t *e;
+  do {
+    e = &journal.entry[--journal.cur & JOURNAL_MASK];
+    apply(e, true);
+  } while(e->type != JOURNAL_CHECKPOINT);
+  journal.open = journal.cur;
+  journal_checkpoint();
+  return true;
+}
+
+// repeat the next undone group of edits, returning false if there isn't one
+bool journal_redo() {
+  if(journal.cur == journal.head) return false;
+  journal.open = journal.cur++; // checkpoint
+  while(journal.cur != journal.head &&
+        journal.entry[journal.cur & JOURNAL_MASK].type != JOURNAL_CHECKPOINT) {
+    apply(&journal.entry[journal.cur++ & JOURNAL_MASK], false);
+  }
+  journal_checkpoint();
+  return true;
+}
+
+TEST(journal) {
+  vec128b v;
+  vec128b_set_zero(&v);
+  vec128b_set_bit(&v, 60);
+  note_pages_reset();
+  if(!scenes_init()) return -1;
+  scene_t *s = &scenes[0];
+
+  journal_checkpoint();
+  journal_notes_or(s, 1, 10, &v);
+  journal_event_insert(s, (event_t) { .beat = 10, .msg = {0x91, 60, 100} });
+  journal_checkpoint();
+  journal_notes_and_not(s, 1, 10, &v);
+  event_map_merge(s->events);
+  journal_event_delete(s, &scene_events_mut(s)->event[0]);
+  if(note_grid_beat_occupied(&s->notes, 1, 10) || event_map_count(s->events) - s->events->deleted != 0) return -2;
+
+  // undo the delete, then the insert
+  if(!journal_undo()) return -3;
+  if(!vec128b_bit_is_set(note_grid_get(&s->notes, 1, 10), 60) ||
+     event_map_count(s->events) - s->events->deleted != 1) return -4;
+  if(!journal_undo() || journal_undo()) return -5;
+  if(note_grid_beat_occupied(&s->notes, 1, 10) ||
+     event_map_count(s->events) - s->events->deleted != 0) return -6;
+  if(!journal_redo()) return -7;
+  if(!vec128b_bit_is_set(note_grid_get(&s->notes, 1, 10), 60)) return -8;
+
+  // a new edit drops what was undone
+  journal_checkpoint();
+  journal_scene(s);
+  scene_clear(s);
+  if(journal_redo() || note_pages_in_use() != 1) return -9;
+  if(!journal_undo() || !note_grid_beat_occupied(&s->notes, 1, 10)) return -10;
+  if(!journal_redo() || note_grid_beat_occupied(&s->notes, 1, 10)) return -11;
+
+  // the oldest groups are dropped when full
+  COUNTUP(i, JOURNAL_SIZE) {
+    journal_checkpoint();
+    journal_notes_or(s, 2, i % BEATS, &v);
+    journal_notes_and_not(s, 2, i % BEATS, &v);
+  }
+  int groups = 0;
+  while(journal_undo()) groups++;
+  if(groups != JOURNAL_SIZE / 3) return -12;
+
+  // a group larger than the journal can't be undone
+  journal_checkpoint();
+  COUNTUP(i, JOURNAL_SIZE) {
+    journal_notes_or(s, 3, i % BEATS, &v);
+    journal_notes_and_not(s, 3, i % BEATS, &v);
+  }
+  if(journal_undo()) return -13;
+
+  scenes_free();
+  if(note_pages_in_use() != 0) return -14;
+  return 0;
+}
@@ -0,0 +1,271 @@
+/* Copyright 2020-2021 Dustin DeWeese
+   This file is part of MidiPush.
+
+    MidiPush is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    MidiPush is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with MidiPush.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "startle/types.h"
+#include "startle/macros.h"
+#include "startle/support.h"
+#include "startle/test.h"
+
+#include "vec128b.h"
+#include "layout.h"
+
+// Pad to note mapping, and the tables derived from it.
+// These are rebuilt when the layout or transposition changes,
+// so drawing the pads is table lookups and bit masks.
+// Tables cover all 12 scales, because the scale can change with every note.
+
+#if INTERFACE
+#define LAYOUT_PADS 64
+
+enum layout_kind {
+  LAYOUT_THIRDS = 0, // rows alternate 3 and 4 semitones apart
+  LAYOUT_FOURTHS,
+  LAYOUT_CHROMATIC,
+  LAYOUT_KINDS
+};
+
+typedef struct layout {
+  int8_t note[LAYOUT_PADS]; // note for each pad, or -1 if out of range
+  uint64_t pads[128]; // pads for each note
+  uint64_t valid; // pads with a note
+  uint64_t in_key[12]; // pads in key, for each scale
+  uint8_t background[12][LAYOUT_PADS]; // background color of each pad, for each scale
+} layout_t;
+#endif
+
+//                                      C  #  D  #  E  F  #  G  #   A  #  B
+static const uint8_t background[12] = {45, 0, 1, 0, 3, 1, 0, 3, 0, 96, 0, 1};
+
+uint8_t background_color(unsigned int note, unsigned int scale) {
+  return background[(12 + note - scale) % 12];
+}
+
+bool in_key(unsigned int scale, unsigned int key) {
+  return !!background[(12 - scale + key) % 12];
+}
+
+const char *layout_name(int kind) {
+  static const char *names[] = {
+    [LAYOUT_THIRDS] = "3/4",
+    [LAYOUT_FOURTHS] = "4th",
+    [LAYOUT_CHROMATIC] = "chr"
+  };
+  return names[kind];
+}
+
+static
+int pad_to_note(int kind, unsigned int pad) {
+  int
+    x = pad & 7,
+    y = pad >> 3;
+  switch(kind) {
+  case LAYOUT_FOURTHS: return x + y * 5;
+  case LAYOUT_CHROMATIC: return x + y * 8;
+  default: return x + y * 7 / 2; // shift rows by alternating 3/4 semitones
+  }
+}
+
+void layout_build(layout_t *l, int kind, int transpose) {
+  memset(l, 0, sizeof(*l));
+  COUNTUP(i, LAYOUT_PADS) {
+    int note = pad_to_note(kind, i) + transpose;
+    if(!INRANGE(note, 0, 127)) {
+      l->note[i] = -1;
+      continue;
+    }
+    uint64_t bit = 1ull << i;
+    l->note[i] = note;
+    l->pads[note] |= bit;
+    l->valid |= bit;
+    COUNTUP(s, 12) {
+      l->background[s][i] = background_color(note, s);
+      if(in_key(s, note)) l->in_key[s] |= bit;
+    }
+  }
+}
+
+// pads showing any of the notes
+uint64_t layout_pads(const layout_t *l, const vec128b *notes) {
+  uint64_t pads = 0;
+  vec128b_foreach_set(n, notes) {
+    pads |= l->pads[n];
+  }
+  return pads;
+}
+
+#if INTERFACE
+// pad colors
+#define PAD_RED 5
+#define PAD_YELLOW 13
+#define PAD_GREEN 21
+#define PAD_PURPLE 53
+
+// which pads show what, as masks of pads
+typedef struct pad_masks {
+  uint64_t pressed, current, playing;
+} pad_masks_t;
+#endif
+
+static
+uint8_t pad_color(const layout_t *l, int scale, const pad_masks_t *m, int i) {
+  uint64_t bit = 1ull << i;
+  return
+    m->pressed & bit ? (l->in_key[scale] & bit ? PAD_GREEN : PAD_PURPLE) :
+    m->current & bit ? PAD_RED :
+    m->playing & bit ? PAD_YELLOW :
+    l->background[scale][i];
+}
+
+uint64_t layout_render_scalar(const layout_t *l, int scale, const pad_masks_t *m, uint8_t *colors) {
+  uint64_t changed = 0;
+  COUNTUP(i, LAYOUT_PADS) {
+    uint8_t c = pad_color(l, scale, m, i);
+    if(colors[i] != c) {
+      colors[i] = c;
+      changed |= 1ull << i;
+    }
+  }
+  return changed;
+}
+
+#if VEC128B_SSE2
+// 16 bits of the mask to 16 bytes of all ones or zeros
+static
+__m128i expand_mask(uint64_t mask, int i) {
+  const __m128i bits = _mm_set_epi8(-128, 64, 32, 16, 8, 4, 2, 1, -128, 64, 32, 16, 8, 4, 2, 1);
+  __m128i x = _mm_cvtsi32_si128((mask >> (i * 16)) & 0xffff);
+  x = _mm_unpacklo_epi8(x, x);
+  x = _mm_unpacklo_epi16(x, x);
+  x = _mm_unpacklo_epi32(x, x); // low byte in the low 8 lanes, high byte in the rest
+  return _mm_cmpeq_epi8(_mm_and_si128(x, bits), bits);
+}
+
+static
+__m128i blend(__m128i mask, __m128i a, __m128i b) {
+  return _mm_or_si128(_mm_and_si128(mask, a), _mm_andnot_si128(mask, b));
+}
+
+uint64_t layout_render(const layout_t *l, int scale, const pad_masks_t *m, uint8_t *colors) {
+  uint64_t changed = 0;
+  uint64_t in_key = m->pressed & l->in_key[scale], out_of_key = m->pressed & ~l->in_key[scale];
+  COUNTUP(i, LAYOUT_PADS / 16) {
+    __m128i c = _mm_loadu_si128((const __m128i *)&l->background[scale][i * 16]);
+    c = blend(expand_mask(m->playing, i), _mm_set1_epi8(PAD_YELLOW), c);
+    c = blend(expand_mask(m->current, i), _mm_set1_epi8(PAD_RED), c);
+    c = blend(expand_mask(in_key, i), _mm_set1_epi8(PAD_GREEN), c);
+    c = blend(expand_mask(out_of_key, i), _mm_set1_epi8(PAD_PURPLE), c);
+    __m128i *p = (__m128i *)&colors[i * 16];
+    unsigned int same = _mm_movemask_epi8(_mm_cmpeq_epi8(c, _mm_loadu_si128(p)));
+    changed |= (uint64_t)(~same & 0xffff) << (i * 16);
+    _mm_storeu_si128(p, c);
+  }
+  return changed;
+}
+#endif
+
+#if VEC128B_NEON
+static const uint8_t mask_bits[16] = { 1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128 };
+
+// 16 bits of the mask to 16 bytes of all ones or zeros
+static
+uint8x16_t expand_mask(uint64_t mask, int i) {
+  uint8x16_t x = vcombine_u8(vdup_n_u8(mask >> (i * 16)), vdup_n_u8(mask >> (i * 16 + 8)));
+  return vtstq_u8(x, vld1q_u8(mask_bits));
+}
+
+uint64_t layout_render(const layout_t *l, int scale, const pad_masks_t *m, uint8_t *colors) {
+  uint64_t changed = 0;
+  uint64_t in_key = m->pressed & l->in_key[scale], out_of_key = m->pressed & ~l->in_key[scale];
+  COUNTUP(i, LAYOUT_PADS / 16) {
+    uint8x16_t c = vld1q_u8(&l->background[scale][i * 16]);
+    c = vbslq_u8(expand_mask(m->playing, i), vdupq_n_u8(PAD_YELLOW), c);
+    c = vbslq_u8(expand_mask(m->current, i), vdupq_n_u8(PAD_RED), c);
+    c = vbslq_u8(expand_mask(in_key, i), vdupq_n_u8(PAD_GREEN), c);
+    c = vbslq_u8(expand_mask(out_of_key, i), vdupq_n_u8(PAD_PURPLE), c);
+    uint8_t *p = &colors[i * 16];
+
+    // pack the differing lanes into bits by adding pairs of lanes
+    uint8x16_t diff = vandq_u8(vmvnq_u8(vceqq_u8(c, vld1q_u8(p))), vld1q_u8(mask_bits));
+    uint8x8_t sum = vpadd_u8(vget_low_u8(diff), vget_high_u8(diff));
+    sum = vpadd_u8(sum, sum);
+    sum = vpadd_u8(sum, sum);
+    changed |= (uint64_t)vget_lane_u16(vreinterpret_u16_u8(sum), 0) << (i * 16);
+    vst1q_u8(p, c);
+  }
+  return changed;
+}
+#endif
+
+#if !VEC128B_SIMD
+uint64_t layout_render(const layout_t *l, int scale, const pad_masks_t *m, uint8_t *colors) {
+  return layout_render_scalar(l, scale, m, colors);
+}
+#endif
+
+TEST(layout_render) {
+  static layout_t l;
+  uint8_t colors[2][LAYOUT_PADS] = {{0}};
+  srand(7);
+  LOOP(1000) {
+    layout_build(&l, rand() % LAYOUT_KINDS, rand() % 100);
+    int scale = rand() % 12;
+    pad_masks_t m = {
+      .pressed = (uint64_t)rand() << 32 ^ rand(),
+      .current = (uint64_t)rand() << 32 ^ rand(),
+      .playing = (uint64_t)rand() << 32 ^ rand()
+    };
+    m.pressed &= (uint64_t)rand() << 32 ^ rand(); // fewer
+    m.pressed &= l.valid;
+    if(layout_render(&l, scale, &m, colors[0]) !=
+       layout_render_scalar(&l, scale, &m, colors[1])) return -1;
+    if(memcmp(colors[0], colors[1], sizeof(colors[0])) != 0) return -2;
+  }
+  return 0;
+}
+
+TEST(layout) {
+  static layout_t l;
+  COUNTUP(kind, LAYOUT_KINDS) {
+    layout_build(&l, kind, 36);
+    COUNTUP(i, LAYOUT_PADS) {
+      int note = l.note[i];
+      if(note < 0) return -1;
+      if(!(l.pads[note] & 1ull << i)) return -2;
+      if(l.background[5][i] != background_color(note, 5)) return -3;
+      if(!!(l.in_key[5] & 1ull << i) != in_key(5, note)) return -4;
+    }
+  }
+
+  // rows alternate 3 and 4 semitones apart
+  layout_build(&l, LAYOUT_THIRDS, 0);
+  if(l.note[8] != 3 || l.note[16] != 7 || l.note[63] != 31) return -5;
+
+  // off the top of the range
+  layout_build(&l, LAYOUT_CHROMATIC, 100);
+  if(l.note[27] != 127 || l.note[28] != -1 || l.valid != (1ull << 28) - 1) return -6;
+
+  vec128b v = {{0}};
+  vec128b_set_bit(&v, 105);
+  if(layout_pads(&l, &v) != (1ull << 5)) return -7;
+  return 0;
+}
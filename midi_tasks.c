@@ -16,6 +16,7 @@
 */
 
 #ifndef DTASK_GEN
+#define MIDI_TASKS_RUN_FUNCTIONS // defined here so the tasks can be inlined
 #include "types.h"
 #include <sys/time.h>
 #include <stdio.h>
@@ -25,18 +26,20 @@
 #include <limits.h>
 #include "startle/types.h"
 #include "startle/macros.h"
-#include "startle/map.h"
 #include "startle/support.h"
 #include "midipush.h"
 #include "vec128b.h"
+#include "beat_frame.h"
+#include "layout.h"
+#include "note_grid.h"
+#include "event_map.h"
+#include "scene.h"
+#include "journal.h"
+#include "automation.h"
+#include "scale.h"
 #include "midi_tasks.h"
 #endif
 
-#define PAD_RED 5
-#define PAD_YELLOW 13
-#define PAD_GREEN 21
-#define PAD_PURPLE 53
-
 #define DEBOUNCE_MS 100
 
 #define MOD_INC(x, m, n) ((x + n) % m)
@@ -50,7 +53,7 @@ enum infer_scale_mode {
   INFER_SCALE_MAX
 };
 
-static_assert(MIDI_TASKS_COUNT <= 64, "too many tasks");
+static_assert(MIDI_TASKS_COUNT <= DTASK_MAX_ID + 1, "too many tasks, increase DTASK_SET_WORDS");
 
 DTASK_GROUP(midi_tasks)
 
@@ -107,6 +110,31 @@ DTASK(beat, struct { unsigned int then, now; }) {
   return true;
 }
 
+// each channel loops over its own length, so it keeps its own position,
+// which follows the global beat except when wrapping at a different length
+DTASK(channel_beat, struct { unsigned int then[16], now[16], len[16], last; }) {
+  const beat_t *b = DREF(beat);
+  const uint8_t *pages = DREF(loop_length)->pages;
+  channel_beat_t *cb = DREF(channel_beat);
+  bool moved = b->then != b->now || b->then != cb->last;
+  bool step = b->then == cb->last && b->now == MOD_INC(b->then, BEATS, 1);
+  COUNTUP(c, 16) {
+    unsigned int len = pages[c] ? pages[c] * BEATS_PER_PAGE : BEATS;
+    cb->len[c] = len;
+    if(step) {
+      cb->then[c] = cb->now[c] % len;
+      cb->now[c] = MOD_INC(cb->then[c], len, 1);
+    } else if(moved) {
+      cb->then[c] = b->then % len;
+      cb->now[c] = b->now % len;
+    } else {
+      cb->then[c] = cb->now[c] = cb->now[c] % len;
+    }
+  }
+  cb->last = b->now;
+  return true;
+}
+
 DTASK(print_midi_msg, bool) {
   const midi_in_t *msg = DREF(midi_in);
   if(msg->status != 0xf8) {
@@ -211,10 +239,10 @@ DTASK_ENABLE(current_note) {
 DTASK(current_note, DELAY(key_event_t, HISTORY)) {
   if(state->events & PAD) {
     const key_event_t *pad = DREF(pad);
-    int id = pad_to_note(pad->id) + *DREF(transpose);
-    if(INRANGE(id, 0, 127)) {
+    int id = DREF_PASS(pad_map)->note[pad->id];
+    if(id >= 0) {
       key_event_t e = {
-        .id = pad_to_note(pad->id) + *DREF(transpose),
+        .id = id,
         .velocity = pad->velocity,
         .tick = *DREF_PASS(tick)
       };
@@ -307,89 +335,188 @@ DTASK(bpm, int) {
   return false;
 }
 
-typedef union {
-  char byte[sizeof(uintptr_t)];
-  uintptr_t data;
-} msg_data_t;
+DTASK_ENABLE(automation_tolerance) {
+  *DREF(automation_tolerance) = 2;
+  printf_text(17, 2, "smooth: %2d", *DREF(automation_tolerance));
+}
+
+// how far recorded pressure and bend may stray from the original values, in pressure steps
+DTASK(automation_tolerance, int) {
+  const control_change_t *cc = DREF(control_change);
+  if(cc->control == 71) {
+    int val = cc->value;
+    if(val >= 64) val = val - 128;
+    *DREF(automation_tolerance) = clamp(0, 16, *DREF(automation_tolerance) + val);
+    printf_text(17, 2, "smooth: %2d", *DREF(automation_tolerance));
+    return true;
+  }
+  return false;
+}
 
 DTASK_ENABLE(record) {
   record_t *record = DREF(record);
+  record->scene = &scenes[DREF(scene_select)->current];
+  record->active = note_grid_channels(&record->scene->notes);
   record->copy.shift = -1;
   record->copy.first_note = -1;
   record->copy.first_beat = -1;
+  record->image.page = -1; // copy mode's source, may refer to another session's scenes
+}
+
+static
+void record_event(record_t *record, unsigned int beat, uint8_t status, uint8_t d1, uint8_t d2) {
+  journal_event_insert(record->scene, (event_t) { .beat = beat, .msg = { status, d1, d2 } });
 }
 
 static
-void delete_notes(record_t *record, unsigned int beat, unsigned int channel, const vec128b *notes) {
-  vec128b_and_not(&record->notes[beat][channel], notes);
-  map_iterator it = map_iterator_begin(record->events, beat);
-  pair_t *p = map_find_iter(&it);
-  while(p) {
-    msg_data_t msg = { .data = p->second };
-    if(msg.byte[0] == (0x90 | channel) &&
-       vec128b_bit_is_set(notes, msg.byte[1])) {
-      p->second = 0;
+void record_automation(record_t *record, unsigned int channel, unsigned int kind,
+                       unsigned int beat, int value, unsigned int tolerance) {
+  automation_point_t out[2];
+  unsigned int n = automation_sample(&record->lanes[channel][kind], kind, tolerance, beat, value, out);
+  COUNTUP(i, n) {
+    journal_event_insert(record->scene, automation_event(channel, kind, out[i]));
+  }
+}
+
+// finish all gestures in progress
+static
+void flush_automation(record_t *record, unsigned int tolerance) {
+  automation_point_t out[2];
+  COUNTUP(c, 16) {
+    COUNTUP(k, AUTOMATION_KINDS) {
+      unsigned int n = automation_flush(&record->lanes[c][k], k, tolerance, out);
+      COUNTUP(i, n) {
+        journal_event_insert(record->scene, automation_event(c, k, out[i]));
+      }
     }
-    p = map_next(&it, p);
   }
 }
 
+// delete the note wherever it's held through the beat, and the note-ons within that span
+static
+void delete_span(record_t *record, unsigned int channel, unsigned int note, unsigned int beat, unsigned int len) {
+  unsigned int first, n = note_grid_span(&record->scene->notes, channel, note, beat, len, &first);
+  if(!n) return;
+  journal_span_clear(record->scene, channel, note, first, n, len);
+  event_map_merge(record->scene->events); // including notes just recorded
+
+  // the channel's events are contiguous, so the span is at most two runs of them
+  while(n) {
+    unsigned int run = min(n, len - first);
+    const event_map_t *m = record->scene->events;
+    uint32_t pos = m->start[EVENT_KEY(channel, first)], end = m->start[EVENT_KEY(channel, first + run - 1) + 1];
+    RANGEUP(i, pos, end) {
+      const event_t *e = &record->scene->events->event[i];
+      if((e->msg[0] & 0xf0) == 0x90 && e->msg[1] == note && !(e->flags & EVENT_DELETED)) {
+        event_map_t *w = scene_events_mut(record->scene); // may copy the events
+        if(!w) return;
+        journal_event_delete(record->scene, &w->event[i]);
+      }
+    }
+    n -= run;
+    first = 0;
+  }
+}
+
+// the first note-on played from the beat, looking ahead through the whole loop
+// returns -1 if there are none
+static
+int first_note_on(const record_t *record, const channel_beat_t *cb, unsigned int beat) {
+  COUNTUP(k, BEATS) {
+    unsigned int src = (beat + k) % BEATS;
+    COUNTUP(c, 16) {
+      size_t n;
+      const event_t *e = event_map_at(record->scene->events, c, src % cb->len[c], &n);
+      COUNTUP(j, n) {
+        if((e[j].msg[0] & 0xf0) == 0x90 && !(e[j].flags & EVENT_DELETED)) return e[j].msg[1];
+      }
+    }
+  }
+  return -1;
+}
+
 // TODO this is too long
-DTASK(record, struct { map_t events; vec128b notes[BEATS][16]; struct { int shift, first_beat, first_note; } copy; vec128b extra[16]; unsigned int active; }) {
+DTASK(record, struct { scene_t *scene; struct { int shift, first_beat, first_note; } copy; beat_frame_t extra; unsigned int active; automation_lane_t lanes[16][AUTOMATION_KINDS]; scene_image_t image; }) {
+  const channel_beat_t *cb = DREF(channel_beat);
   unsigned int beat = DREF_PASS(beat)->then;
   int channel = *DREF_PASS(channel);
   record_t *record = DREF(record);
-  memset(record->extra, 0, sizeof(record->extra));
+  memset(&record->extra, 0, sizeof(record->extra));
 
-  if(state->events & SET_PAGE) {
-    if(DREF(set_page)->note >= 0) {
-      if(record->copy.first_beat < 0) {
-        int start = page_beat(beat, DREF(set_page));
-        COUNTUP(i, BEATS) {
-          COUNTUP(c, 16) {
-            if(!vec128b_zero(&record->notes[start][c])) {
-              goto found_start;
-            }
-          }
-          start = MOD_INC(start, BEATS, 1);
-        }
-      found_start:
-        record->copy.first_beat = start;
+  // each gesture can be undone separately, and is finished before saving
+  if(state->events & (SCENE_SELECT | SET_PAGE | NEW_BUTTON | DELETING | RECORDING | SAVE | POWEROFF)) {
+    flush_automation(record, *DREF_PASS(automation_tolerance));
+    journal_checkpoint();
+    record->image.page = -1;
+  }
+
+  if(state->events & (SAVE | POWEROFF)) {
+    (void)DREF(save);
+    (void)DREF(poweroff);
+    return false;
+  }
+
+  if(state->events & UNDO) {
+    (void)DREF(undo);
+    record->image.page = -1;
+    COUNTUP(c, 16) {
+      COUNTUP(k, AUTOMATION_KINDS) {
+        record->lanes[c][k].active = false; // drop, the journal has moved on
       }
-      record->copy.shift = MOD_DEC(beat, BEATS, record->copy.first_beat - 1);
-    } else {
-      record->copy.shift = -1;
-      record->copy.first_note = -1;
-      record->copy.first_beat = -1;
     }
+    record->active = note_grid_channels(&record->scene->notes);
     return true;
   }
 
+  if(state->events & SCENE_SELECT) {
+    record->scene = &scenes[DREF(scene_select)->current];
+    record->active = note_grid_channels(&record->scene->notes);
+    record->copy.shift = -1;
+    record->copy.first_note = -1;
+    record->copy.first_beat = -1;
+    return true;
+  }
+
+  // before SET_PAGE, because New also resets the page
   if(*DREF(new_button)) {
+    if(state->events & NEW_BUTTON) journal_scene(record->scene);
     if(*DREF(deleting)) {
-      map_clear(record->events);
-      memset(record->notes, 0, sizeof(record->notes));
+      scene_clear(record->scene);
       record->active = 0;
     } else {
-      FORMAP(i, record->events) {
-        pair_t *p = &record->events[i];
-        msg_data_t msg = { .data = p->second };
-        if((msg.byte[0] & 0xf) == channel) {
-          p->second = 0;
-        }
-      }
-      map_filter(record->events, nonzero_value);
+      event_map_t *m = scene_events_mut(record->scene);
+      if(m) event_map_clear_channel(m, channel);
 
-      COUNTUP(i, BEATS) {
-        vec128b_set_zero(&record->notes[i][channel]);
-      }
+      note_grid_clear_channel(&record->scene->notes, channel);
       record->active &= ~(1 << channel);
     }
+    record->copy.shift = -1;
+    record->copy.first_note = -1;
+    record->copy.first_beat = -1;
+    return true;
+  }
+
+  if(state->events & SET_PAGE) {
+    if(DREF(set_page)->note >= 0) {
+      if(record->copy.first_beat < 0) {
+        int start = page_beat(beat, DREF(set_page));
+        int found = note_grid_next_beat(&record->scene->notes, 0xffff, start);
+        record->copy.first_beat = found >= 0 ? found : start;
+        record->copy.first_note = first_note_on(record, cb, record->copy.first_beat);
+      }
+      record->copy.shift = MOD_DEC(beat, BEATS, record->copy.first_beat - 1);
+    } else {
+      record->copy.shift = -1;
+      record->copy.first_note = -1;
+      record->copy.first_beat = -1;
+    }
     return true;
   }
 
-  int start = DREF(beat)->then, stop = DREF(beat)->now;
-  if((stop - start + BEATS) % BEATS > BEATS / 2) {
+  // the current channel's beats, within its loop
+  unsigned int len = cb->len[channel];
+  int start = cb->then[channel], stop = cb->now[channel];
+  if((stop - start + len) % len > len / 2) {
     int tmp = start;
     start = stop;
     stop = tmp;
@@ -398,105 +525,87 @@ DTASK(record, struct { map_t events; vec128b notes[BEATS][16]; struct { int shif
   if(*DREF(deleting) &&
      DREF(notes)->cnt != 0) {
 
-    // clear the tails from notes that will be deleted
-    vec128b clear = DREF(notes)->v;
-    vec128b_and(&clear, &record->notes[MOD_DEC(stop, BEATS, 1)][channel]);
-    for(int i = stop;
-        !vec128b_zero(&clear);
-        i = MOD_INC(i, BEATS, 1)) {
-      vec128b_and(&clear, &record->notes[i][channel]);
-      vec128b_and_not(&record->notes[i][channel], &clear);
-    }
-
-    // clear the heads from notes that will be deleted
-    clear = DREF(notes)->v;
-    vec128b_and(&clear, &record->notes[start][channel]);
-    for(int i = MOD_DEC(start, BEATS, 1);
-        !vec128b_zero(&clear);
-        i = MOD_DEC(i, BEATS, 1)) {
-      vec128b_and(&clear, &record->notes[i][channel]);
-      delete_notes(record, i, channel, &clear);
-    }
-
-    // delete the notes inside the period
-    for(int i = start; i != stop; i = MOD_INC(i, BEATS, 1)) {
-      delete_notes(record, i, channel, &DREF(notes)->v);
+    // delete the whole span of each pressed note held during the period, or at the current beat
+    record->image.page = -1;
+    unsigned int n = max(1, (stop - start + len) % len);
+    COUNTUP(k, n) {
+      unsigned int i = (start + k) % len;
+      vec128b held = DREF(notes)->v;
+      vec128b_and(&held, note_grid_get(&record->scene->notes, channel, i));
+      vec128b_foreach_set(note, &held) {
+        delete_span(record, channel, note, i, len);
+      }
     }
 
     return true;
   }
 
-  if(state->events & DELETING) {
-    // delete disabled, so collect garbage
-    map_filter(record->events, nonzero_value);
-  }
-
   // copy
   if(record->copy.shift >= 0) {
     unsigned int disable = *DREF_PASS(disable_channel);
     bool change = false;
-    // copy ahead one beat for playback
+    // copy ahead one beat for playback, in global beats wrapped to each channel's loop
+    start = DREF_PASS(beat)->then;
+    stop = DREF_PASS(beat)->now;
+    if((stop - start + BEATS) % BEATS > BEATS / 2) {
+      int tmp = start;
+      start = stop;
+      stop = tmp;
+    }
     start = MOD_INC(start, BEATS, 1);
     stop = MOD_INC(stop, BEATS, 1);
     for(int i = start; i != stop; i = MOD_INC(i, BEATS, 1)) {
       int src = MOD_DEC(i, BEATS, record->copy.shift);
+      unsigned int dst_beat[16];
+      COUNTUP(c, 16) {
+        dst_beat[c] = i % cb->len[c];
+      }
+      if(record->copy.first_note < 0) continue; // nothing to copy
+      int transpose = DREF(set_page)->note - record->copy.first_note;
+      int page = src / BEATS_PER_PAGE;
+      scene_image_t *img = &record->image;
+      if(!scene_image_valid(img, record->scene, cb->len, page, transpose)) {
+        scene_image_build(img, record->scene, cb->len, page, transpose);
+      }
+      unsigned int b = src % BEATS_PER_PAGE;
 
       // events
-      map_iterator it = map_iterator_begin(record->events, src);
-      pair_t *p = map_find_iter(&it);
-      while(p) {
-        msg_data_t msg = { .data = p->second };
-        if(record->copy.first_note < 0) {
-          if((msg.byte[0] & 0xf0) == 0x90) {
-            record->copy.first_note = (int)msg.byte[1];
-          }
-        } else {
-          int c = msg.byte[0] & 0x0f;
-          if(!(disable & 1 << c)) {
-            if((msg.byte[0] & 0xf0) == 0x90) {
-              int transpose = DREF(set_page)->note - record->copy.first_note;
-              int n = msg.byte[1] + transpose;
-              if(INRANGE(n, 0, 127)) { // transpose notes
-                msg.byte[1] = n;
-                if(*DREF(recording) && !vec128b_bit_is_set(&record->notes[i][c], n)) {
-                  map_insert(record->events, PAIR(i, msg.data));
-                } else {
-                  synth_note(c, n, true, msg.byte[2]);
-                }
-              }
-            } else {
-              if(*DREF(recording)) {
-                map_insert(record->events, PAIR(i, msg.data));
-              } else {
-                int n = min(sizeof(msg.byte), fixed_length(msg.byte[0]));
-                write_synth((seg_t) { .n = n, .s = msg.byte });
-              }
+      COUNTUP(c, 16) {
+        if(disable & 1 << c) continue;
+        size_t n = scene_image_count(img, b, c);
+        COUNTUP(j, n) {
+          event_t e;
+          if(!scene_image_event(img, b, c, j, &e)) continue;
+          if(*DREF(recording)) {
+            if((e.msg[0] & 0xf0) != 0x90 ||
+               !vec128b_bit_is_set(note_grid_get(&record->scene->notes, c, dst_beat[c]), e.msg[1])) {
+              e.beat = dst_beat[c];
+              journal_event_insert(record->scene, e);
+              scene_image_written(img, c, dst_beat[c]);
+              change = true;
+              continue;
             }
-            change = true;
           }
+          if((e.msg[0] & 0xf0) == 0x90) {
+            synth_note(c, e.msg[1], true, e.msg[2]);
+          } else {
+            int len = min(sizeof(e.msg), fixed_length(e.msg[0]));
+            write_synth((seg_t) { .n = len, .s = (char *)e.msg });
+          }
+          change = true;
         }
-        p = map_next(&it, p);
       }
 
       // notes
-      if(record->copy.first_note >= 0) {
-        int transpose = DREF(set_page)->note - record->copy.first_note;
-        COUNTUP(c, 16) {
-          if(!(disable & 1 << c)) {
-            vec128b src_notes = record->notes[src][c];
-            if(transpose >= 0) {
-              vec128b_shiftl(&src_notes, transpose);
-            } else {
-              vec128b_shiftr(&src_notes, -transpose);
-            }
-            //if(~record->notes[i][c] & src_notes) change = true;
-            if(!vec128b_zero(&src_notes)) change = true; // *** ^
-            if(*DREF(recording)) {
-              vec128b_or(&record->notes[i][c], &src_notes);
-            }
-            vec128b_or(&record->extra[c], &src_notes);
-          }
+      COUNTUP(c, 16) {
+        if(disable & 1 << c) continue;
+        const vec128b *src_notes = &img->notes[b][c];
+        if(vec128b_zero(src_notes)) continue;
+        change = true;
+        if(*DREF(recording) && journal_notes_or(record->scene, c, dst_beat[c], src_notes)) {
+          scene_image_written(img, c, dst_beat[c]);
         }
+        vec128b_or(&record->extra.ch[c], src_notes);
       }
     }
     return change;
@@ -504,45 +613,35 @@ DTASK(record, struct { map_t events; vec128b notes[BEATS][16]; struct { int shif
 
   if(*DREF(recording)) {
     bool change = false;
+    unsigned int at = cb->then[channel];
     // events
     if(state->events & CURRENT_NOTE) {
       const key_event_t *note = DELAY_READ(DREF(current_note), key_event_t, HISTORY, 0);
       if(note->velocity > 0 &&
-         !vec128b_bit_is_set(&record->notes[beat][channel], note->id) &&
+         !vec128b_bit_is_set(note_grid_get(&record->scene->notes, channel, at), note->id) &&
          (*DREF_PASS(infer_scale_mode) != INFER_SCALE_LOCK ||
           in_key(*DREF_PASS(infer_scale), note->id))) {
-        msg_data_t msg = {{
-            0x90 | channel,
-            note->id,
-            note->velocity
-          }};
-        map_insert(record->events, PAIR(beat, msg.data));
+        record_event(record, at, 0x90 | channel, note->id, note->velocity);
         change = true;
       }
     }
     if(state->events & CHANNEL_PRESSURE) {
-      msg_data_t msg = {{
-          0xd0 | channel,
-          *DREF(channel_pressure)
-        }};
-      map_insert(record->events, PAIR(beat, msg.data));
+      record_automation(record, channel, AUTOMATION_PRESSURE, at,
+                        *DREF(channel_pressure), *DREF_PASS(automation_tolerance));
       change = true;
     }
     if(state->events & PITCH_BEND) {
-      msg_data_t msg = {{
-          0xe0 | channel,
-          *DREF(pitch_bend) & 0x7f,
-          (*DREF(pitch_bend) >> 7) & 0x7f
-        }};
-      map_insert(record->events, PAIR(beat, msg.data));
+      record_automation(record, channel, AUTOMATION_BEND, at,
+                        *DREF(pitch_bend), *DREF_PASS(automation_tolerance));
       change = true;
     }
 
     // notes
     int i = start;
     while(i != stop) {
-      vec128b_or(&record->notes[i][channel], &DREF(notes)->v);
-      i = MOD_INC(i, BEATS, 1);
+      // out of note pages, counted and shown by show_dropped
+      if(!journal_notes_or(record->scene, channel, i, &DREF(notes)->v)) break;
+      i = MOD_INC(i, len, 1);
     }
 
     // mark the channel active
@@ -644,11 +743,61 @@ DTASK(set_page, struct { int val, set, keep, note; }) {
   return false;
 }
 
-DTASK(playback, struct { vec128b played[16]; }) {
-  vec128b *played = DREF(playback)->played;
-  unsigned int beat = DREF(beat)->now;
-  vec128b *notes = DREF(record)->notes[beat];
-  vec128b *extra = DREF(record)->extra;
+// each channel's notes at its beat, for the channels in the mask
+static
+void channel_notes(const note_grid_t *g, const unsigned int *beat, unsigned int mask, beat_frame_t *f) {
+  COUNTUP(c, BEAT_FRAME_CHANNELS) {
+    if(mask & 1u << c) {
+      f->ch[c] = *note_grid_get(g, c, beat[c]);
+    } else {
+      vec128b_set_zero(&f->ch[c]);
+    }
+  }
+}
+
+// interpolate toward the next point if it's the end of a ramp
+static
+void start_ramp(automation_ramp_t (*ramps)[AUTOMATION_KINDS], event_map_t *m, const event_t *e, unsigned int len) {
+  unsigned int c = e->msg[0] & 0x0f, kind = automation_kind(e->msg[0]);
+  automation_ramp_t *r = &ramps[c][kind];
+  event_t next;
+  r->active = false;
+  if(automation_next(m, e->msg[0], e->beat, len, &next) &&
+     next.flags & EVENT_RAMP &&
+     next.beat > e->beat) {
+    *r = (automation_ramp_t) {
+      .active = true,
+      .from = e->beat,
+      .to = next.beat,
+      .from_value = automation_event_value(e),
+      .to_value = automation_event_value(&next)
+    };
+    r->sent = r->from_value;
+  }
+}
+
+// send interpolated values between the points of active ramps
+static
+void play_ramps(automation_ramp_t *ramps, unsigned int channel, unsigned int beat) {
+  COUNTUP(k, AUTOMATION_KINDS) {
+    automation_ramp_t *r = &ramps[k];
+    int value = automation_ramp_value(r, beat);
+    if(value < 0) {
+      r->active = false;
+    } else if(beat != r->from && beat != r->to && value != r->sent) {
+      event_t e = automation_event(channel, k, (automation_point_t) { .beat = beat, .value = value });
+      write_synth((seg_t) { .n = k == AUTOMATION_BEND ? 3 : 2, .s = (char *)e.msg });
+      r->sent = value;
+    }
+  }
+}
+
+DTASK(playback, struct { beat_frame_t played; automation_ramp_t ramps[16][AUTOMATION_KINDS]; }) {
+  beat_frame_t *played = &DREF(playback)->played;
+  automation_ramp_t (*ramps)[AUTOMATION_KINDS] = DREF(playback)->ramps;
+  const unsigned int *beat = DREF(channel_beat)->now;
+  const note_grid_t *notes = &DREF(record)->scene->notes;
+  const beat_frame_t *extra = &DREF(record)->extra;
   int channel = *DREF_PASS(channel);
   unsigned int disable = *DREF_PASS(disable_channel);
   bool changed = false;
@@ -674,39 +823,42 @@ DTASK(playback, struct { vec128b played[16]; }) {
           });
       }
     }
-    map_iterator it = map_iterator_begin(DREF(record)->events, beat);
-    pair_t *p = map_find_iter(&it);
-    while(p) {
-      msg_data_t msg = { .data = p->second };
-      int control = msg.byte[0] & 0xf0;
-      if(control == 0x90) {
-        int c = msg.byte[0] & 0x0f;
-        if(!(disable & 1ull << c)) {
-          synth_note(c, msg.byte[1], true, msg.byte[2]);
-          vec128b_set_bit(&played[c], msg.byte[1]);
+    // disabled channels' events aren't looked at
+    COUNTUP(c, 16) {
+      if(disable & 1ull << c) continue;
+      size_t cnt;
+      const event_t *events = event_map_at(DREF(record)->scene->events, c, beat[c], &cnt);
+      COUNTUP(i, cnt) {
+        const event_t *e = &events[i];
+        if(e->flags & EVENT_DELETED) continue;
+        int control = e->msg[0] & 0xf0;
+        if(control == 0x90) {
+          synth_note(c, e->msg[1], true, e->msg[2]);
+          vec128b_set_bit(&played->ch[c], e->msg[1]);
           changed = true;
+        } else if(ONEOF(control, 0xd0, 0xe0)) {
+          int n = min(sizeof(e->msg), fixed_length(e->msg[0]));
+          write_synth((seg_t) { .n = n, .s = (char *)e->msg });
+          start_ramp(ramps, DREF(record)->scene->events, e, DREF(channel_beat)->len[c]);
         }
-      } else if(ONEOF(control, 0xd0, 0xe0)) {
-        int n = min(sizeof(msg.byte), fixed_length(msg.byte[0]));
-        write_synth((seg_t) { .n = n, .s = msg.byte });
       }
-      p = map_next(&it, p);
+      play_ramps(ramps[c], c, beat[c]);
     }
-    COUNTUP(c, 16) {
-      if(disable & 1ull << c) {
-        continue;
-      }
-      vec128b pressed = notes[c];
-      vec128b_or(&pressed, &extra[c]);
-      if(c == channel) vec128b_or(&pressed, &DREF(notes)->v);
-      vec128b released = played[c];
-      vec128b_and_not(&released, &pressed);
-      COUNTUP(i, 128) {
-        if(vec128b_bit_is_set(&released, i)) {
-          synth_note(c, i, false, 0);
-          vec128b_clear_bit(&played[c], i);
-          changed = true;
-        }
+    unsigned int enabled = ~disable & 0xffff;
+    beat_frame_t pressed, released = *played;
+    channel_notes(notes, beat, enabled, &pressed);
+    beat_frame_or(&pressed, extra);
+    vec128b_or(&pressed.ch[channel], &DREF(notes)->v);
+    beat_frame_and_not(&released, &pressed);
+    beat_frame_mask(&released, enabled);
+    unsigned int off = beat_frame_nonzero(&released);
+    while(off) {
+      int c = __builtin_ctz(off);
+      off &= off - 1;
+      vec128b_foreach_set(i, &released.ch[c]) {
+        synth_note(c, i, false, 0);
+        vec128b_clear_bit(&played->ch[c], i);
+        changed = true;
       }
     }
   } else if(state->events & PLAYING) {
@@ -714,23 +866,15 @@ DTASK(playback, struct { vec128b played[16]; }) {
     COUNTDOWN(c, 16) {
       all_notes_off(c);
     }
+    memset(ramps, 0, sizeof(DREF(playback)->ramps));
   }
   return changed;
 }
 
-// TODO optimize
-int min_note(vec128b *v) {
-  COUNTUP(n, 128) {
-    if(vec128b_bit_is_set(v, n)) {
-      return n;
-    }
-  }
-  return -1;
-}
-
 DTASK_ENABLE(show_playback) {
+  const layout_t *pad_map = DREF(pad_map);
   COUNTUP(i, 64) {
-    int c = background_color(pad_to_note(i) + *DREF(transpose), *DREF(infer_scale));
+    int c = pad_map->background[*DREF(infer_scale)][i];
     DREF(show_playback)->pad_state[i] = c;
     set_pad_color(i, c);
   }
@@ -738,50 +882,34 @@ DTASK_ENABLE(show_playback) {
 
 DTASK(show_playback, struct { uint8_t pad_state[64]; }) {
   uint8_t *pad_state = DREF(show_playback)->pad_state;
-  unsigned int beat = DREF(beat)->now;
-  vec128b *extra = DREF(record)->extra;
+  const unsigned int *beat = DREF(channel_beat)->now;
+  const beat_frame_t *extra = &DREF(record)->extra;
   int channel = *DREF(channel);
   unsigned int disable = *DREF(disable_channel);
   uint64_t pads = *DREF(pads);
-  vec128b notes[16];
+  beat_frame_t notes;
   vec128b all_notes = DREF(notes)->v;
 
-  COUNTUP(c, 16) {
-    notes[c] = DREF(record)->notes[beat][c];
-    vec128b_or(&notes[c], &extra[c]);
-    if(!(disable & 1u << c)) {
-      vec128b_or(&all_notes, &notes[c]);
-    }
-  }
+  channel_notes(&DREF(record)->scene->notes, beat, 0xffff, &notes);
+  beat_frame_or(&notes, extra);
+  beat_frame_reduce(&notes, ~disable, &all_notes);
   if(!(disable & 1u << channel)) {
-    vec128b_or(&notes[channel], &DREF(notes)->v);
+    vec128b_or(&notes.ch[channel], &DREF(notes)->v);
   }
 
+  const layout_t *pad_map = DREF(pad_map);
   int scale = *DREF(infer_scale);
-  bool changed = false;
-  COUNTUP(i, 64) {
-    uint64_t bit = 1ull << i;
-    int note = pad_to_note(i) + *DREF(transpose);
-    int color = 0;
-    if(INRANGE(note, 0, 127)) {
-      color = background_color(note, scale);
-      if(vec128b_bit_is_set(&all_notes, note)) {
-        color = PAD_YELLOW;
-        if(vec128b_bit_is_set(&notes[channel], note)) {
-          color = PAD_RED;
-        }
-      }
-      if(pads & bit) {
-        color = in_key(*DREF(infer_scale), note) ? PAD_GREEN : PAD_PURPLE;
-      }
-    }
-    if(pad_state[i] != color) {
-      set_pad_color(i, color);
-      pad_state[i] = color;
-      changed = true;
-    }
+  pad_masks_t m = {
+    .pressed = pads & pad_map->valid,
+    .playing = layout_pads(pad_map, &all_notes)
+  };
+  m.current = layout_pads(pad_map, &notes.ch[channel]) & m.playing;
+  uint64_t changed = layout_render(pad_map, scale, &m, pad_state);
+  for(uint64_t c = changed; c; c &= c - 1) {
+    int i = __builtin_ctzll(c);
+    set_pad_color(i, pad_state[i]);
   }
-  int base_note = min_note(&DREF(notes)->v);
+  int base_note = vec128b_first_set(&DREF(notes)->v);
   if(base_note >= 0) { // show base note
     printf_text(0, 0, "note: %.2s, octave: %2d, number: %3d",
                 get_note_name(base_note),
@@ -792,6 +920,17 @@ DTASK(show_playback, struct { uint8_t pad_state[64]; }) {
   return changed;
 }
 
+// notes and events that couldn't be stored, shown once there are any
+DTASK(show_dropped, struct { uint32_t notes, events; }) {
+  show_dropped_t *d = DREF(show_dropped);
+  uint32_t notes = note_pages_dropped(), events = DREF(record)->scene->events->dropped;
+  if(notes == d->notes && events == d->events) return false;
+  d->notes = notes;
+  d->events = events;
+  printf_text(34, 2, "lost: %5u", notes + events);
+  return true;
+}
+
 DTASK_ENABLE(light_bar) {
   COUNTUP(i, 8) {
     send_msg(0xb0, i + 20, 0);
@@ -799,15 +938,20 @@ DTASK_ENABLE(light_bar) {
   }
 }
 
-DTASK(light_bar, int) {
-  int new = DREF(beat)->now / BEATS_PER_PAGE;
-  int old = *DREF_WEAK(light_bar);
-  int diff = new ^ old;
-  if(diff & 0x07) send_msg(0xb0, (old & 7) + 20, 0);
-  if(diff & 0x38) send_msg(0xb0, ((old >> 3) & 7) + 102, 0);
-  send_msg(0xb0, (new & 7) + 20, 22);
-  send_msg(0xb0, ((new >> 3) & 7) + 102, 22);
-  *DREF(light_bar) = new;
+// light the current page, and dimly light pages with notes
+DTASK(light_bar, struct { uint8_t top[8], bottom[8]; }) {
+  light_bar_t *lb = DREF(light_bar);
+  int page = DREF(beat)->now / BEATS_PER_PAGE;
+  uint64_t content = note_grid_pages(&DREF(record)->scene->notes, 0xffff);
+  int group = page & 0x38;
+  COUNTUP(i, 8) {
+    int top = (page & 7) == (int)i ? 22 : content >> (group | i) & 1 ? 19 : 0;
+    int bottom = page >> 3 == (int)i ? 22 : content >> (i * 8) & 0xff ? 19 : 0;
+    if(lb->top[i] != top) send_msg(0xb0, i + 20, top);
+    if(lb->bottom[i] != bottom) send_msg(0xb0, i + 102, bottom);
+    lb->top[i] = top;
+    lb->bottom[i] = bottom;
+  }
   return true;
 }
 
@@ -982,6 +1126,39 @@ DTASK_ENABLE(transpose) {
 
 const int upper_limit = 128 - 24 + ALIGNMENT_PADDING(128 - 24, 12);
 
+static void show_layout(int kind) {
+  printf_text(17, 1, "layout: %s", layout_name(kind));
+}
+
+DTASK_ENABLE(pad_layout) {
+  int *kind = DREF(pad_layout);
+  send_msg(0xb0, 50, 1);
+  if(!INRANGE(*kind, 0, LAYOUT_KINDS - 1)) *kind = LAYOUT_THIRDS;
+  show_layout(*kind);
+}
+
+// the Note button cycles through the pad layouts
+DTASK(pad_layout, int) {
+  const control_change_t *cc = DREF(control_change);
+  int *kind = DREF(pad_layout);
+  if(cc->control == 50 && cc->value) {
+    *kind = (*kind + 1) % LAYOUT_KINDS;
+    show_layout(*kind);
+    return true;
+  }
+  return false;
+}
+
+DTASK_ENABLE(pad_map) {
+  layout_build(DREF(pad_map), *DREF(pad_layout), *DREF(transpose));
+}
+
+// the note for each pad, and how to light it
+DTASK(pad_map, layout_t) {
+  layout_build(DREF(pad_map), *DREF(pad_layout), *DREF(transpose));
+  return true;
+}
+
 DTASK(transpose, int8_t) {
   const control_change_t *cc = DREF(control_change);
   if(ONEOF(cc->control, 46, 47) && cc->value) {
@@ -1037,6 +1214,80 @@ DTASK(page_mask, unsigned int) {
   return false;
 }
 
+DTASK_ENABLE(loop_length) {
+  send_msg(0xb0, 90, 1);
+}
+
+// Fixed Length ends the current channel's loop after the current page,
+// or restores the full length
+DTASK(loop_length, struct { uint8_t pages[16]; }) {
+  const control_change_t *cc = DREF(control_change);
+  int channel = *DREF(channel);
+  uint8_t *pages = DREF(loop_length)->pages;
+  bool changed = false;
+  if((state->events & CONTROL_CHANGE) && cc->control == 90 && cc->value) {
+    pages[channel] = pages[channel] ? 0 : DREF_PASS(beat)->now / BEATS_PER_PAGE + 1;
+    changed = true;
+  }
+  if(changed || (state->events & CHANNEL)) {
+    send_msg(0xb0, 90, pages[channel] ? 4 : 1);
+  }
+  return changed;
+}
+
+DTASK_ENABLE(scene_select) {
+  scene_select_t *sel = DREF(scene_select);
+  sel->next = sel->current;
+  printf_text(17, 3, "scene: %2d ", sel->current + 1);
+}
+
+// Page < / > queue the previous or next scene, and Duplicate copies the current scene into the next one.
+// A queued scene starts at the next page boundary so the loop isn't cut off mid-phrase.
+DTASK(scene_select, struct { unsigned int current, next; }) {
+  scene_select_t *sel = DREF(scene_select);
+  const control_change_t *cc = DREF(control_change);
+  unsigned int next = sel->next;
+  if((state->events & CONTROL_CHANGE) && cc->value) {
+    switch(cc->control) {
+    case 62: next = (sel->next + SCENES - 1) % SCENES; break;
+    case 63: next = (sel->next + 1) % SCENES; break;
+    case 88:
+      next = (sel->current + 1) % SCENES;
+      journal_checkpoint();
+      journal_scene(&scenes[next]);
+      scene_copy(&scenes[next], &scenes[sel->current]);
+      break;
+    }
+  }
+  bool changed = false;
+  if(next != sel->current &&
+     (!*DREF_PASS(playing) || DREF(beat)->now % BEATS_PER_PAGE == 0)) {
+    sel->current = next;
+    changed = true;
+  }
+  if(changed || next != sel->next) {
+    sel->next = next;
+    printf_text(17, 3, "scene: %2d%s", sel->current + 1, next != sel->current ? "*" : " ");
+  }
+  return changed;
+}
+
+DTASK_ENABLE(undo) {
+  send_msg(0xb0, 119, 1);
+}
+
+// Undo reverses the last edit, and Shift + Undo repeats it
+DTASK(undo, struct { bool shift; }) {
+  const control_change_t *cc = DREF(control_change);
+  undo_t *undo = DREF(undo);
+  if(cc->control == 49) {
+    undo->shift = !!cc->value;
+  } else if(cc->control == 119 && cc->value) {
+    return undo->shift ? journal_redo() : journal_undo();
+  }
+  return false;
+}
+
 DTASK_ENABLE(set_metronome) {
   DREF(set_metronome)->channel = -1;
 }
@@ -1048,7 +1299,7 @@ DTASK(set_metronome, struct { int channel, note; }) {
     if(DREF_PASS(notes)->cnt == 0) {
       m->channel = -1;
     } else {
-      int n = min_note(&DREF_PASS(notes)->v);
+      int n = vec128b_first_set(&DREF_PASS(notes)->v);
       if(n >= 0) {
           m->channel = *DREF_PASS(channel);
           m->note = n;
@@ -1076,8 +1327,27 @@ DTASK(metronome, bool) {
   return false;
 }
 
+// catch up with the notes already in the history, unless it was loaded
+DTASK_ENABLE(scale_history) {
+  pitch_history_t *h = DREF(scale_history);
+  if(h->seq) return;
+  pitch_history_init(h);
+  COUNTDOWN(i, HISTORY) {
+    const key_event_t *e = DELAY_READ(DREF(current_note), key_event_t, HISTORY, i);
+    pitch_history_add(h, e->id, e->velocity);
+  }
+}
+
+// the order pitch classes were played in, for infer_scale
+DTASK(scale_history, pitch_history_t) {
+  const key_event_t *note = DELAY_READ(DREF(current_note), key_event_t, HISTORY, 0);
+  pitch_history_add(DREF(scale_history), note->id, note->velocity);
+  return true;
+}
+
 DTASK_ENABLE(infer_scale) {
   *DREF(infer_scale) = 0;
+  scale_table_init();
 }
 
 // Switch as fast as possible, especially on chords
@@ -1085,57 +1355,18 @@ DTASK_ENABLE(infer_scale) {
 // Pressing 0/4/7 repeatedly doesn't change scale
 // Minor scale selects the corresponding majpr scale
 DTASK(infer_scale, int) {
-  // simple fixed point representation
-#define F(x) (4*(x))
-  static const int8_t f[12] = { // convolution filter in fixed point
-     F(2.5),   F(-1),  F(1), F(-1),
-    F(2.25),    F(1), F(-1),  F(2),
-      F(-1), F(1.25), F(-1),  F(1)
-  };
-  static const int8_t f_chord = F(6.75); // f[0] + f[4] + f[7], a major chord
-  if((state->events & CURRENT_NOTE) &&
-     *DREF(infer_scale_mode) &&
-      DELAY_READ(DREF(current_note), key_event_t, HISTORY, 0)->velocity > 0) {
+  if(!(state->events & SCALE_HISTORY)) return false;
+  const key_event_t *note = DELAY_READ(DREF_PASS(current_note), key_event_t, HISTORY, 0);
+  if(*DREF(infer_scale_mode) && note->velocity > 0) {
     const int prev_scale = *DREF(infer_scale);
-    int c[12] = {0};
-    int cnt = 0;
-    int set = 0;
-    for(int i = 0; i < HISTORY && cnt < 7; i++) {
-      const key_event_t *e = DELAY_READ(DREF(current_note), key_event_t, HISTORY, i);
-      if(e->id <= 0) break;
-      if(e->velocity <= 0) continue;
-      int s = e->id % 12;
-      int bit = 1 << s;
-      if(!(set & bit)) {
-        cnt++;
-        set |= bit;
-        bool done = false;
-        COUNTUP(j, 12) {
-          c[j] += f[(12 + s - j) % 12];
-          if(cnt == 3 && c[j] >= f_chord) {
-            done = true; // matched a chord, finish
-          }
-        }
-        if(done) break;
-      }
-    }
-
-    // bias towards previous scale
-    c[prev_scale] += cnt * F(0.5); // cnt * (f[0] - f[4]), so that repeated 4 or 7 won't switch
-    int c_max = c[prev_scale], c_i = prev_scale;
-    COUNTUP(i, 12) {
-      if(c[i] > c_max) {
-        c_max = c[i];
-        c_i = i;
-      }
-    }
-    if(prev_scale != c_i) {
-      *DREF(infer_scale) = c_i;
+    unsigned int cnt, set = pitch_history_set(DREF(scale_history), &cnt);
+    int s = scale_infer(set, cnt, prev_scale);
+    if(prev_scale != s) {
+      *DREF(infer_scale) = s;
       return true;
     }
   }
   return false;
-#undef F
 }
 
 static
@@ -20,6 +20,7 @@
 #include <stdint.h>
 #include <unistd.h>
 #include <sys/time.h>
+#include <sys/stat.h>
 #include <poll.h>
 #include <stdarg.h>
 #include <endian.h>
@@ -40,6 +41,14 @@
 #include "startle/static_alloc.h"
 
 #include "vec128b.h"
+#include "beat_frame.h"
+#include "layout.h"
+#include "note_grid.h"
+#include "event_map.h"
+#include "scene.h"
+#include "automation.h"
+#include "scale.h"
+#include "coalesce.h"
 #include "midi_tasks.h"
 #include "midipush.h"
 
@@ -58,9 +67,20 @@ const unsigned long long initial =
   TRANSPOSE |
   SHOW_VOLUME |
   SHOW_PLAYBACK |
+  SHOW_DROPPED |
   POWEROFF |
   SAVE |
-  METRONOME;
+  METRONOME |
+  AUTOMATION_TOLERANCE;
+
+// tasks that only render the latest state, run once per batch of input
+const unsigned long long deferred =
+  SHOW_PLAYBACK |
+  SHOW_DROPPED |
+  LIGHT_BAR |
+  SHOW_PROGRAM |
+  SHOW_VOLUME |
+  SHOW_DISABLE_CHANNEL;
 
 struct midi {
   snd_rawmidi_t *in, *out;
@@ -96,11 +116,21 @@ void midi_close(struct midi *p) {
   snd_rawmidi_close(p->out);
 }
 
+#define PUSH_IDENTITY_TIMEOUT_MS 1000
+
+// sent before the identity request
 static char push_init[] = {
   0xF0, 0x47, 0x7F, 0x15, 0x63, 0x00, 0x01, 0x05, 0xF7, // touch strip mode
   0xF0, 0x47, 0x7F, 0x15, 0x5C, 0x00, 0x01, 0x01, 0xF7, // channel aftertouch
   0xF0, 0x47, 0x7F, 0x15, 0x62, 0x00, 0x01, 0x00, 0xF7, // live mode
-  0xF0, 0x7E, 0x00, 0x06, 0x01, 0xF7,
+};
+
+static char push_identity_request[] = {
+  0xF0, 0x7E, 0x00, 0x06, 0x01, 0xF7
+};
+
+// sent after the identity reply
+static char push_setup[] = {
   0xF0, 0x47, 0x7F, 0x15, 0x57, 0x00, 0x14, 0x00, 0x00, // calibration
         0x0D, 0x07, 0x00, 0x03, 0x0E, 0x08, 0x00, 0x00,
         0x0C, 0x08, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
@@ -144,14 +174,14 @@ void set_pad_threshold(int x) {
     { 0x01, 0x06, 0x09, 0x00, 0x01, 0x09, 0x00 },
     { 0x01, 0x07, 0x02, 0x00, 0x01, 0x09, 0x0A }
   };
-  write_midi((seg_t) { .n = 8,
-      .s = (uint8_t [8]) { 0xF0, 0x47, 0x7F, 0x15, 0x5D, 0x00, 0x20, 0x00 }});
-  write_midi((seg_t) { .n = sizeof(pad_thresh[0]), .s = pad_thresh[x] });
-  write_midi((seg_t) { .n = 25, .s = (uint8_t[25]) {
-        0x00, 0x00, 0x00, 0x02, 0x02, 0x02, 0x0E, 0x00,
-        0x00, 0x00, 0x00, 0x01, 0x0D, 0x04, 0x0C, 0x00,
-        0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xF7
-      }});
+  uint8_t msg[40] = {
+    0xF0, 0x47, 0x7F, 0x15, 0x5D, 0x00, 0x20, 0x00,
+    [15] = 0x00, 0x00, 0x00, 0x02, 0x02, 0x02, 0x0E, 0x00,
+           0x00, 0x00, 0x00, 0x01, 0x0D, 0x04, 0x0C, 0x00,
+           0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xF7
+  };
+  memcpy(&msg[8], pad_thresh[x], sizeof(pad_thresh[0]));
+  write_midi((seg_t) { .n = sizeof(msg), .s = (char *)msg }); // one write for the whole sysex
 }
 
 void set_pad_curve(int x) {
@@ -164,12 +194,13 @@ void set_pad_curve(int x) {
     { 0x01, 0x0F, 0x0B, 0x0D, 0x00, 0x00, 0x00, 0x00, 0x01, 0x0D, 0x04, 0x0C, 0x00, 0x00, 0x00, 0x00, 0x00, 0x0C, 0x03, 0x05 },
     { 0x02, 0x02, 0x02, 0x0E, 0x00, 0x00, 0x00, 0x00, 0x01, 0x0D, 0x04, 0x0C, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 }
   };
-  write_midi((seg_t) { .n = 18,
-      .s = (uint8_t [18]) {
-        0xF0, 0x47, 0x7F, 0x15, 0x5D, 0x00, 0x20, 0x00,
-        0x01, 0x07, 0x02, 0x00, 0x01, 0x09, 0x0A, 0x00, 0x00, 0x00 }});
-  write_midi((seg_t) { .n = sizeof(pad_curve[0]), .s = pad_curve[x] });
-  write_midi((seg_t) { .n = 2, .s = (uint8_t [2]) { 0x00, 0xf7 }});
+  uint8_t msg[40] = {
+    0xF0, 0x47, 0x7F, 0x15, 0x5D, 0x00, 0x20, 0x00,
+    0x01, 0x07, 0x02, 0x00, 0x01, 0x09, 0x0A, 0x00, 0x00, 0x00,
+    [38] = 0x00, 0xf7
+  };
+  memcpy(&msg[18], pad_curve[x], sizeof(pad_curve[0]));
+  write_midi((seg_t) { .n = sizeof(msg), .s = (char *)msg }); // one write for the whole sysex
 }
 
 static midi_tasks_state_t midi_state = DTASK_STATE(midi_tasks, 0, 0);
@@ -236,6 +267,34 @@ seg_t find_midi_msg(unsigned char *status, const char **s, const char *e) {
   return msg;
 }
 
+static
+long long time_ms() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec * 1000ll + tv.tv_usec / 1000;
+}
+
+static coalesce_t push_coalesce;
+
+static
+void dispatch_midi_msg(int id, uint8_t status, seg_t msg, midi_tasks_state_t *state, dtask_set_t *events) {
+  midi_state.midi_in.status = status;
+  midi_state.midi_in.id = id;
+  midi_state.midi_in.data = msg;
+  *events |= midi_tasks_run_midi_in((dtask_state_t *)state);
+}
+
+// pass on held continuous input from the Push, only if due unless all is set
+static
+void flush_coalesced(midi_tasks_state_t *state, dtask_set_t *events, bool all) {
+  static uint8_t held[3];
+  long long now = time_ms();
+  while(coalesce_take(&push_coalesce, now, all, held)) {
+    dispatch_midi_msg(push.id, held[0], (seg_t) { .s = (char *)held + 1, .n = fixed_length(held[0]) - 1 },
+                      state, events);
+  }
+}
+
 static
 bool read_midi_msgs(struct midi *m, midi_tasks_state_t *state, dtask_set_t *events) {
   bool success = true;
@@ -268,11 +327,14 @@ bool read_midi_msgs(struct midi *m, midi_tasks_state_t *state, dtask_set_t *even
       COUNTUP(i, msg.n) printf(" %02x", msg.s[i]);
       printf("\n");
 #endif
-      midi_state.midi_in.status = m->last_status;
+      uint8_t status = m->last_status;
       if(!msg.n) m->last_status = 0; // ***
-      midi_state.midi_in.id = m->id;
-      midi_state.midi_in.data = msg;
-      *events |= dtask_run((dtask_state_t *)state, MIDI_IN);
+      if(m == &push) {
+        if(msg.n >= 1 &&
+           coalesce_put(&push_coalesce, status, (const uint8_t *)msg.s, time_ms())) continue;
+        flush_coalesced(state, events, true);
+      }
+      dispatch_midi_msg(m->id, status, msg, state, events);
       if(midi_state.poweroff) {
         success = false;
         break;
@@ -286,8 +348,66 @@ bool read_midi_msgs(struct midi *m, midi_tasks_state_t *state, dtask_set_t *even
   return success;
 }
 
+// one second of Push input at 1000 messages/s, in bursts of notes and encoder turns
+// returns the time spent running tasks, deferring the UI to the end of each burst if batched
+static
+long long run_bursts(midi_tasks_state_t *state, bool batched) {
+  static const uint8_t controls[] = { 14, 44, 45, 48, 71, 78, 79 };
+  static char data[2];
+  dtask_state_t *s = (dtask_state_t *)state;
+  dtask_enable(s, initial & ~PRINT_MIDI_MSG);
+  dtask_defer(s, batched ? deferred : 0);
+  dtask_select(s);
+  LOOP(10) midi_tasks_run_external_tick(s);
+
+  srand(7);
+  long long t = 0;
+  int left = 1000;
+  while(left > 0) {
+    int n = min(left, 1 + rand() % 16);
+    dtask_set_t events = 0;
+    left -= n;
+    long long t0 = time_ns();
+    LOOP(n) {
+      if(rand() % 2) {
+        state->midi_in.status = rand() % 2 ? 0x90 : 0x80;
+        data[0] = 36 + rand() % 64;
+        data[1] = 1 + rand() % 126;
+      } else {
+        state->midi_in.status = 0xb0;
+        data[0] = controls[rand() % LENGTH(controls)];
+        data[1] = rand() % 2 ? 1 : 127;
+      }
+      state->midi_in.id = 0;
+      state->midi_in.data = (seg_t) { .s = data, .n = 2 };
+      events |= midi_tasks_run_midi_in(s);
+    }
+    dtask_run_deferred(s, events);
+    t += time_ns() - t0;
+  }
+  return t;
+}
+
+static midi_tasks_state_t batch_test_each = DTASK_STATE(midi_tasks, 0, 0);
+static midi_tasks_state_t batch_test_batched = DTASK_STATE(midi_tasks, 0, 0);
+
+TEST(midi_in_batch) {
+  midi_tasks_state_t *each = &batch_test_each, *batched = &batch_test_batched;
+  scenes_init();
+  long long t_each = run_bursts(each, false);
+  long long t_batched = run_bursts(batched, true);
+  printf("one second at 1000 messages/s: %lld us running tasks, %lld us batched\n",
+         t_each / 1000, t_batched / 1000);
+
+  // the UI ends up the same
+  if(memcmp(&each->show_playback, &batched->show_playback, sizeof(each->show_playback)) ||
+     memcmp(&each->light_bar, &batched->light_bar, sizeof(each->light_bar))) return -1;
+  return 0;
+}
+
+// output is dropped if the device isn't open, e.g. when tests run tasks
 void write_midi(seg_t s) {
-  if(!_write_midi_file.active) {
+  if(!_write_midi_file.active && push.out) {
     snd_rawmidi_write(push.out, s.s, s.n);
   }
 }
@@ -302,7 +422,7 @@ void write_synth(seg_t s) {
 #endif
   if(_write_midi_file.active) {
     write_midi_file_event(s);
-  } else {
+  } else if(synth.out) {
     while(s.n) {
       ssize_t n = snd_rawmidi_write(synth.out, s.s, s.n);
       assert_throw(n >= 0, "write_synth: write error %d\n", n);
@@ -364,8 +484,6 @@ void all_notes_off(int channel) {
   });
 }
 
-//                                      C  #  D  #  E  F  #  G  #   A  #  B
-static const uint8_t background[12] = {45, 0, 1, 0, 3, 1, 0, 3, 0, 96, 0, 1};
 static const char note_name[24] = "C C#D D#E F F#G G#A A#B ";
 
 char *get_note_name(unsigned int note) {
@@ -376,22 +494,6 @@ int get_note_octave(unsigned int note) {
   return note / 12;
 }
 
-uint8_t background_color(unsigned int note, unsigned int scale) {
-  return background[(12 + note - scale) % 12];
-}
-
-bool in_key(unsigned int scale, unsigned int key) {
-  return !!background[(12 - scale + key) % 12];
-}
-
-unsigned int pad_to_note(unsigned int pad) {
-  int
-    x = pad & 7,
-    y = pad >> 3;
-  return
-    x + y * 3.5; // shift rows by alternating 3/4 semitones
-}
-
 void write_text(int x, int y, seg_t s) {
   write_midi((seg_t) {
     .n = 8,
@@ -441,28 +543,432 @@ int get_pfds(snd_rawmidi_t *m, struct pollfd *pfds, int pfds_n) {
   return n;
 }
 
+static
+void write_all(snd_rawmidi_t *out, const char *s, size_t n) {
+  while(n) {
+    ssize_t r = snd_rawmidi_write(out, s, n);
+    assert_throw(r >= 0, "Problem sending initialization: %s", snd_strerror(r));
+    s += r;
+    n -= r;
+  }
+}
+
+// send each sysex in the buffer with a single write
+static
+void push_send(const char *s, size_t n) {
+  const char *e = s + n;
+  while(s < e) {
+    const char *p = s;
+    while(p < e && (unsigned char)*p++ != 0xf7);
+    write_all(push.out, s, p - s);
+    s = p;
+  }
+}
+
+// wait for the reply to push_identity_request
+// anything received after the reply is left in the ring buffer for the event loop
+static
+bool push_wait_identity(int timeout_ms) {
+  struct pollfd pfds[4];
+  int pfds_n = get_pfds(push.in, pfds, LENGTH(pfds));
+  long long deadline = time_ms() + timeout_ms;
+  char buf[256];
+  size_t n = 0;
+  unsigned char status = 0;
+  long long left;
+  while((left = deadline - time_ms()) > 0 &&
+        poll(pfds, pfds_n, left) > 0) {
+    ssize_t r = snd_rawmidi_read(push.in, buf + n, sizeof(buf) - n);
+    if(r < 0) {
+      if(r == -EAGAIN) continue;
+      break;
+    }
+    n += r;
+    const char *p = buf, *e = buf + n;
+    seg_t msg;
+    while(msg = find_midi_msg(&status, &p, e), msg.s) {
+      if(status == 0xf0 && msg.n >= 4 &&
+         msg.s[0] == 0x7e && msg.s[2] == 0x06 && msg.s[3] == 0x02) { // identity reply
+        rb_write(push.rb, p, e - p);
+        return true;
+      }
+    }
+
+    // keep a partial message for the next read
+    n = e - p;
+    if(n == sizeof(buf)) n = 0;
+    memmove(buf, p, n);
+  }
+  return false;
+}
+
+// saved state layout:
+//   header, for each task: (name length, name, size, task state),
+//   for each scene: note grid, index of the first scene sharing its events, and if it's this one, (event count, events),
+//   note page count, (page index, page)..., crc
+// Tasks are saved by name, so tasks can be added, removed, or changed without losing the rest.
+#define STATE_MAGIC 0x4d505354
+#define STATE_VERSION 1
+
+struct state_header {
+  uint32_t magic, version;
+  uint32_t size; // number of tasks
+};
+
+typedef struct state_field {
+  const char *name;
+  size_t offset, size;
+} state_field_t;
+
+#define STATE_FIELD(task) { #task, offsetof(midi_tasks_state_t, task), sizeof(((midi_tasks_state_t *)0)->task) },
+static const state_field_t state_fields[] = { MIDI_TASKS_FOREACH_TASK(STATE_FIELD) };
+
+static
+const state_field_t *find_state_field(const char *name) {
+  FOREACH(i, state_fields) {
+    if(strcmp(state_fields[i].name, name) == 0) return &state_fields[i];
+  }
+  return NULL;
+}
+
+static
+bool read_crc(int fd, uLong *crc, void *p, size_t n) {
+  if(read(fd, p, n) != (ssize_t)n) return false;
+  *crc = crc32(*crc, p, n);
+  return true;
+}
+
+static
+bool skip_crc(int fd, uLong *crc, size_t n) {
+  char buf[256];
+  while(n) {
+    size_t k = min(n, sizeof(buf));
+    if(!read_crc(fd, crc, buf, k)) return false;
+    n -= k;
+  }
+  return true;
+}
+
+static
+bool write_crc(int fd, uLong *crc, const void *p, size_t n) {
+  *crc = crc32(*crc, p, n);
+  return write(fd, p, n) == (ssize_t)n;
+}
+
+// read n tasks saved by name, skipping any that no longer exist or changed size
+static
+bool read_task_state(int fd, uLong *crc, uint32_t n, midi_tasks_state_t *state) {
+  LOOP(n) {
+    uint8_t len;
+    char name[256];
+    uint32_t size;
+    if(!(read_crc(fd, crc, &len, sizeof(len)) &&
+         read_crc(fd, crc, name, len) &&
+         read_crc(fd, crc, &size, sizeof(size)))) return false;
+    name[len] = '\0';
+    const state_field_t *f = find_state_field(name);
+    if(f && f->size == size) {
+      if(!read_crc(fd, crc, (char *)state + f->offset, size)) return false;
+    } else {
+      printf("dropped saved state for: %s\n", name);
+      if(!skip_crc(fd, crc, size)) return false;
+    }
+  }
+  return true;
+}
+
+static
+bool write_task_state(int fd, uLong *crc, const midi_tasks_state_t *state) {
+  FOREACH(i, state_fields) {
+    const state_field_t *f = &state_fields[i];
+    uint8_t len = strlen(f->name);
+    uint32_t size = f->size;
+    if(!(write_crc(fd, crc, &len, sizeof(len)) &&
+         write_crc(fd, crc, f->name, len) &&
+         write_crc(fd, crc, &size, sizeof(size)) &&
+         write_crc(fd, crc, (const char *)state + f->offset, size))) return false;
+  }
+  return true;
+}
+
+// The first saved state had no header: the task state as laid out in memory, with notes for every beat
+// in the record, then the whole record event map, a (size, count) pair followed by (beat, message) pairs,
+// and the crc.
+struct dense_record { void *events; vec128b notes[BEATS][16]; struct { int shift, first_beat, first_note; } copy; vec128b extra[16]; unsigned int active; };
+
+#define DENSE_RECORD_PAIRS (1 << 15)
+
+typedef struct dense_field {
+  const char *name;
+  size_t size, align;
+} dense_field_t;
+
+#define DENSE_FIELD(name, ...) { #name, sizeof(__VA_ARGS__), __alignof__(__VA_ARGS__) }
+
+// every task in the headerless state, in order
+static const dense_field_t dense_fields[] = {
+  DENSE_FIELD(external_tick, bool),
+  DENSE_FIELD(midi_in, struct { int id; unsigned char status; seg_t data; }),
+  DENSE_FIELD(time_of_day, struct timeval),
+  DENSE_FIELD(channel_pressure, int),
+  DENSE_FIELD(control_change, struct { int control, value; }),
+  DENSE_FIELD(external_key, key_event_t),
+  DENSE_FIELD(pad, key_event_t),
+  DENSE_FIELD(pitch_bend, int),
+  DENSE_FIELD(print_midi_msg, bool),
+  DENSE_FIELD(bpm, int),
+  DENSE_FIELD(channel, int),
+  DENSE_FIELD(infer_scale_mode, int),
+  DENSE_FIELD(new_button, bool),
+  DENSE_FIELD(page_mask, unsigned int),
+  DENSE_FIELD(playing, bool),
+  DENSE_FIELD(poweroff, bool),
+  DENSE_FIELD(recording, bool),
+  DENSE_FIELD(save, bool),
+  DENSE_FIELD(shuttle, int8_t),
+  DENSE_FIELD(transpose, int8_t),
+  DENSE_FIELD(deleting, bool),
+  DENSE_FIELD(disable_channel, unsigned int),
+  DENSE_FIELD(pads, uint64_t),
+  DENSE_FIELD(program, struct { int bank[16], program[16]; }),
+  DENSE_FIELD(tick, long long),
+  DENSE_FIELD(volume, struct { int arr[16]; }),
+  DENSE_FIELD(current_note, DELAY(key_event_t, HISTORY)),
+  DENSE_FIELD(show_program, bool),
+  DENSE_FIELD(show_volume, bool),
+  DENSE_FIELD(infer_scale, int),
+  DENSE_FIELD(notes, struct { vec128b v; int cnt; }),
+  DENSE_FIELD(set_page, struct { int val, set, keep, note; }),
+  DENSE_FIELD(beat, struct { unsigned int then, now; }),
+  DENSE_FIELD(passthrough, bool),
+  DENSE_FIELD(set_metronome, struct { int channel, note; }),
+  DENSE_FIELD(light_bar, int),
+  DENSE_FIELD(metronome, bool),
+  DENSE_FIELD(record, struct dense_record),
+  DENSE_FIELD(playback, struct { vec128b played[16]; }),
+  DENSE_FIELD(show_disable_channel, bool),
+  DENSE_FIELD(show_playback, struct { uint8_t pad_state[64]; })
+};
+
+// find the offset of each field in the headerless task state, and return its size
+// The task state followed the dtask header, which is a whole number of words, so it starts aligned.
+static
+size_t dense_offsets(size_t *offset) {
+  size_t o = 0, align = __alignof__(dtask_state_t);
+  FOREACH(i, dense_fields) {
+    const dense_field_t *f = &dense_fields[i];
+    align = max(align, f->align);
+    o = DIV_UP(o, f->align) * f->align;
+    offset[i] = o;
+    o += f->size;
+  }
+  return DIV_UP(o, align) * align;
+}
+
+// copy the tasks that still have the same size
+static
+void convert_dense_tasks(const char *saved, const size_t *offset, midi_tasks_state_t *state) {
+  FOREACH(i, dense_fields) {
+    const dense_field_t *f = &dense_fields[i];
+    const state_field_t *s = find_state_field(f->name);
+    if(!s || s->size != f->size) continue;
+    memcpy((char *)state + s->offset, saved + offset[i], f->size);
+  }
+}
+
+// move the notes for every beat out of the record into pages
+// note_grid_summarize() rebuilds the summaries once the pages are loaded
+// returns false if there aren't enough pages
+static
+bool convert_dense_notes(const struct dense_record *record, note_grid_t *notes) {
+  COUNTUP(beat, BEATS) {
+    COUNTUP(c, 16) {
+      vec128b v;
+      memcpy(&v, &record->notes[beat][c], sizeof(v));
+      if(!note_grid_or(notes, c, beat, &v)) return false;
+    }
+  }
+  return true;
+}
+
+// replace the scene's events, which can be in any order, dropping deleted ones
+static
+bool build_scene_events(scene_t *s, event_t *events, size_t n) {
+  size_t k = 0;
+  COUNTUP(i, n) {
+    if(!(events[i].flags & EVENT_DELETED)) events[k++] = events[i];
+  }
+  event_map_release(s->events);
+  return
+    (s->events = event_map_new(EVENT_MAP_MAX_SIZE)) &&
+    event_map_reserve(s->events, max(k, EVENT_MAP_MIN_SIZE)) &&
+    event_map_build(s->events, events, k);
+}
+
+// events from (beat, message) pairs, where a zero message is deleted
+// returns the number of events
+static
+size_t events_from_pairs(event_t *events, const pair_t *pairs, size_t n) {
+  size_t k = 0;
+  COUNTUP(i, n) {
+    if(!pairs[i].second) continue;
+    event_t *e = &events[k++];
+    *e = (event_t) { .beat = pairs[i].first };
+    memcpy(e->msg, &pairs[i].second, sizeof(e->msg));
+  }
+  return k;
+}
+
+// events are saved sorted by key, so they can be read directly
+static
+bool read_events(int fd, uLong *crc, scene_t *s) {
+  uint32_t n;
+  return
+    read_crc(fd, crc, &n, sizeof(n)) &&
+    (s->events = event_map_new(EVENT_MAP_MAX_SIZE)) &&
+    event_map_reserve(s->events, max(n, EVENT_MAP_MIN_SIZE)) &&
+    read_crc(fd, crc, s->events->event, n * sizeof(event_t)) &&
+    event_map_index(s->events, n);
+}
+
+static
+bool read_scene(int fd, uLong *crc, unsigned int i) {
+  scene_t *s = &scenes[i];
+  uint8_t shared;
+  if(!(read_crc(fd, crc, &s->notes, sizeof(s->notes)) &&
+       read_crc(fd, crc, &shared, sizeof(shared)) &&
+       shared <= i)) return false;
+  if(shared < i) {
+    s->events = scenes[shared].events;
+    s->events->refs++;
+    return true;
+  }
+  return read_events(fd, crc, s);
+}
+
+static
+bool write_scene(int fd, uLong *crc, unsigned int i) {
+  const scene_t *s = &scenes[i];
+  uint8_t shared = 0;
+  while(scenes[shared].events != s->events) shared++;
+  event_map_merge(s->events);
+  uint32_t n_events = event_map_count(s->events);
+  return
+    write_crc(fd, crc, &s->notes, sizeof(s->notes)) &&
+    write_crc(fd, crc, &shared, sizeof(shared)) &&
+    (shared < i ||
+     (write_crc(fd, crc, &n_events, sizeof(n_events)) &&
+      write_crc(fd, crc, s->events->event, n_events * sizeof(event_t))));
+}
+
+// read the headerless state into the first scene
+static
+bool read_dense_state(int fd, midi_tasks_state_t *state) {
+  size_t offset[LENGTH(dense_fields)];
+  size_t size = dense_offsets(offset);
+  struct stat st;
+  if(fstat(fd, &st) != 0 ||
+     (size_t)st.st_size != size + DENSE_RECORD_PAIRS * sizeof(pair_t) + sizeof(uLong) ||
+     lseek(fd, 0, SEEK_SET) != 0) return false;
+  uLong crc = crc32(0L, Z_NULL, 0), crc_read;
+  char *saved = malloc(size);
+  pair_t *pairs = malloc(DENSE_RECORD_PAIRS * sizeof(pair_t));
+  event_t *events = malloc(DENSE_RECORD_PAIRS * sizeof(event_t));
+  bool ok = saved && pairs && events &&
+    read_crc(fd, &crc, saved, size) &&
+    read_crc(fd, &crc, pairs, DENSE_RECORD_PAIRS * sizeof(pair_t)) &&
+    read(fd, &crc_read, sizeof(crc_read)) == sizeof(crc_read) &&
+    crc == crc_read &&
+    pairs[0].second < DENSE_RECORD_PAIRS &&
+    scenes_init();
+  if(ok) {
+    const struct dense_record *record = NULL;
+    FOREACH(i, dense_fields) {
+      if(strcmp(dense_fields[i].name, "record") == 0) record = (const struct dense_record *)(saved + offset[i]);
+    }
+    convert_dense_tasks(saved, offset, state);
+    ok = convert_dense_notes(record, &scenes[0].notes) &&
+      build_scene_events(&scenes[0], events, events_from_pairs(events, &pairs[1], pairs[0].second));
+  }
+  free(saved);
+  free(pairs);
+  free(events);
+  return ok;
+}
+
+// move a state file that couldn't be loaded out of the way, so it isn't saved over
+static
+void keep_bad_state(const char *name) {
+  char bad[256];
+  COUNTUP(i, 100) {
+    snprintf(bad, sizeof(bad), "%s.bad%d", name, (int)i);
+    if(access(bad, F_OK) == 0) continue;
+    if(rename(name, bad) == 0) printf("kept bad state as: %s\n", bad);
+    return;
+  }
+}
+
 static
 bool load_state(const char *name, midi_tasks_state_t *state) {
   int fd = open(name, O_RDONLY);
   if(fd >= 0) {
     char *task_specific = (char *)state + sizeof(dtask_state_t);
     size_t task_specific_size = sizeof(*state) - sizeof(dtask_state_t);
-    read(fd, task_specific, task_specific_size);
-    read(fd, record, static_sizeof(record)); // ***
-    uLong crc = crc32(0L, Z_NULL, 0);
-    crc = crc32(crc, task_specific, task_specific_size);
-    crc = crc32(crc, record, static_sizeof(record));
-    state->record.events = record;
-    uLong crc_read;
-    read(fd, &crc_read, sizeof(crc_read));
+    uLong crc = crc32(0L, Z_NULL, 0), crc_read;
+    struct state_header header;
+    uint32_t n_pages = 0;
+    scenes_free();
+    note_pages_reset();
+    bool ok = read_crc(fd, &crc, &header, sizeof(header));
+    if(ok && header.magic != STATE_MAGIC) {
+      header.version = 0;
+      ok = read_dense_state(fd, state);
+    } else {
+      ok = ok &&
+        header.version == STATE_VERSION &&
+        read_task_state(fd, &crc, header.size, state);
+      FOREACH(i, scenes) {
+        if(!ok) break;
+        ok = read_scene(fd, &crc, i);
+      }
+      ok = ok &&
+        read_crc(fd, &crc, &n_pages, sizeof(n_pages));
+      LOOP(ok ? n_pages : 0) {
+        uint16_t p;
+        note_page_t *page;
+        ok = read_crc(fd, &crc, &p, sizeof(p)) &&
+          (page = note_page_load(p)) &&
+          read_crc(fd, &crc, page, sizeof(note_page_t));
+        if(!ok) break;
+      }
+      ok = ok &&
+        read(fd, &crc_read, sizeof(crc_read)) == sizeof(crc_read) &&
+        crc == crc_read;
+    }
+    ok = ok && state->scene_select.current < SCENES;
+    if(ok) {
+      if(!header.version) note_grid_summarize(&scenes[0].notes);
+      note_page_refs_reset();
+      FOREACH(i, scenes) {
+        if(!ok) break;
+        ok = note_grid_add_refs(&scenes[i].notes);
+      }
+      note_pages_sweep();
+    }
     close(fd);
-    if(crc == crc_read) {
+    if(ok) {
       printf("state loaded from: %s\n", name);
+      if(!header.version) printf("converted from the headerless state\n");
       return true;
     } else {
-      printf("bad crc: %s\n", name);
+      printf("bad state: %s\n", name);
       memset(task_specific, 0, task_specific_size);
-      memset(record, 0, static_sizeof(record));
+      FOREACH(i, scenes) {
+        memset(&scenes[i].notes, 0, sizeof(scenes[i].notes)); // may refer to missing pages
+      }
+      note_pages_reset();
+      scenes_init();
+      keep_bad_state(name);
     }
   } else {
     printf("failed to load: %s\n", name);
@@ -474,21 +980,184 @@ static
 void save_state(const char *name, const midi_tasks_state_t *state) {
   int fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
   if(fd >= 0) {
-    char *task_specific = (char *)state + sizeof(dtask_state_t);
-    size_t task_specific_size = sizeof(*state) - sizeof(dtask_state_t);
+    struct state_header header = {
+      .magic = STATE_MAGIC,
+      .version = STATE_VERSION,
+      .size = LENGTH(state_fields)
+    };
+    uint32_t n_pages = note_pages_in_use();
     uLong crc = crc32(0L, Z_NULL, 0);
-    crc = crc32(crc, (const Bytef *)task_specific, task_specific_size);
-    crc = crc32(crc, (const Bytef *)record, static_sizeof(record));
-    write(fd, task_specific, task_specific_size);
-    write(fd, record, static_sizeof(record)); // ***
-    write(fd, &crc, sizeof(crc));
+    bool ok =
+      write_crc(fd, &crc, &header, sizeof(header)) &&
+      write_task_state(fd, &crc, state);
+    FOREACH(i, scenes) {
+      if(!ok) break;
+      ok = write_scene(fd, &crc, i);
+    }
+    ok = ok &&
+      write_crc(fd, &crc, &n_pages, sizeof(n_pages));
+    RANGEUP(i, 1, NOTE_PAGES) {
+      if(!ok) break;
+      if(note_page_refs[i]) {
+        uint16_t p = i;
+        ok = write_crc(fd, &crc, &p, sizeof(p)) &&
+          write_crc(fd, &crc, &note_pages[p], sizeof(note_page_t));
+      }
+    }
+    ok = ok && write(fd, &crc, sizeof(crc)) == sizeof(crc);
     close(fd);
-    printf("state saved to: %s\n", name);
+    if(ok) {
+      const event_map_t *m = state->record.scene->events;
+      printf("state saved to: %s\n", name);
+      printf("record: %d events, %u%% full, grown %u times, %u dropped\n",
+             (int)event_map_count(m), event_map_fill(m), m->grown, m->dropped);
+      COUNTUP(c, 16) {
+        COUNTUP(k, AUTOMATION_KINDS) {
+          unsigned int n = automation_points(state->record.scene->events, c, k);
+          const automation_lane_t *l = &state->record.lanes[c][k];
+          if(!n && !l->samples) continue;
+          printf("channel %d %s: %u points, %u bytes, recorded %u from %u messages\n",
+                 (int)c + 1, k == AUTOMATION_BEND ? "bend" : "pressure",
+                 n, n * (unsigned int)sizeof(event_t), l->points, l->samples);
+        }
+      }
+    } else {
+      printf("failed to write: %s\n", name);
+    }
   } else {
     printf("failed to save: %s\n", name);
   }
 }
 
+static midi_tasks_state_t state_test = DTASK_STATE(midi_tasks, 0, 0);
+
+// check the state loaded by state_file into the given scene, and reset it
+static
+int check_loaded_state(const char *name, unsigned int scene) {
+  int ret = 0;
+  size_t n;
+  memset((char *)&state_test + sizeof(dtask_state_t), 0, sizeof(state_test) - sizeof(dtask_state_t));
+  if(!load_state(name, &state_test)) ret = -1;
+  else if(state_test.bpm != 123 || state_test.scene_select.current != scene) ret = -2;
+  else if(!vec128b_bit_is_set(note_grid_get(&scenes[scene].notes, 1, 50), 60) ||
+          !vec128b_zero(note_grid_get(&scenes[scene + 1].notes, 1, 50))) ret = -3;
+  else if(event_map_at(scenes[scene].events, 1, 50, &n), n != 1 ||
+          event_map_count(scenes[scene + 1].events) != 0) ret = -4;
+  scenes_init();
+  note_pages_reset();
+  return ret;
+}
+
+// write a headerless state with the tasks in state, the record's notes, and one event at beat 50
+static
+bool write_dense_state(const char *name, const midi_tasks_state_t *state, const struct dense_record *record) {
+  size_t offset[LENGTH(dense_fields)];
+  size_t size = dense_offsets(offset);
+  char *saved = calloc(1, size);
+  pair_t *pairs = calloc(DENSE_RECORD_PAIRS, sizeof(pair_t));
+  uLong crc = crc32(0L, Z_NULL, 0);
+  int fd = saved && pairs ? open(name, O_WRONLY | O_TRUNC) : -1;
+  FOREACH(i, dense_fields) {
+    if(fd < 0) break;
+    const dense_field_t *f = &dense_fields[i];
+    const state_field_t *s = find_state_field(f->name);
+    if(strcmp(f->name, "record") == 0) {
+      memcpy(saved + offset[i], record, sizeof(*record));
+    } else if(s && s->size == f->size) {
+      memcpy(saved + offset[i], (const char *)state + s->offset, f->size);
+    }
+  }
+  if(fd >= 0) {
+    pairs[0] = PAIR(DENSE_RECORD_PAIRS, 1);
+    pairs[1] = PAIR(50, 0x91 | 60 << 8 | 100 << 16);
+  }
+  bool ok = fd >= 0 &&
+    write_crc(fd, &crc, saved, size) &&
+    write_crc(fd, &crc, pairs, DENSE_RECORD_PAIRS * sizeof(pair_t)) &&
+    write(fd, &crc, sizeof(crc)) == sizeof(crc);
+  if(fd >= 0) close(fd);
+  free(saved);
+  free(pairs);
+  return ok;
+}
+
+TEST(state_file) {
+  char name[] = "/tmp/midipush-test-XXXXXX";
+  int fd = mkstemp(name);
+  if(fd < 0) return -10;
+  close(fd);
+  vec128b v;
+  vec128b_set_zero(&v);
+  vec128b_set_bit(&v, 60);
+
+  scenes_init();
+  note_pages_reset();
+  state_test.bpm = 123;
+  state_test.scene_select.current = 2;
+  state_test.record.scene = &scenes[2];
+  note_grid_or(&scenes[2].notes, 1, 50, &v);
+  event_map_insert(scene_events_mut(&scenes[2]), (event_t) { .beat = 50, .msg = {0x91, 60, 100} });
+  save_state(name, &state_test);
+  int ret = check_loaded_state(name, 2);
+  if(ret) goto done;
+
+  // the headerless state converts into the first scene
+  struct dense_record *record = calloc(1, sizeof(*record));
+  if(record) memcpy(&record->notes[50][1], &v, sizeof(v));
+  ret = record && write_dense_state(name, &state_test, record) ? check_loaded_state(name, 0) * 10 : -12;
+  free(record);
+  if(ret) goto done;
+
+  // a bad state file is moved out of the way
+  char bad[sizeof(name) + 8];
+  snprintf(bad, sizeof(bad), "%s.bad0", name);
+  fd = open(name, O_WRONLY | O_TRUNC);
+  if(fd < 0 || write(fd, "bad", 3) != 3) ret = -13;
+  if(fd >= 0) close(fd);
+  if(!ret && (load_state(name, &state_test) ||
+              access(name, F_OK) == 0 ||
+              access(bad, F_OK) != 0)) ret = -14;
+  unlink(bad);
+
+done:
+  unlink(name);
+  return ret;
+}
+
+// a headerless state with notes held on every beat of every channel converts without losing any
+TEST(state_file_dense) {
+  char name[] = "/tmp/midipush-test-XXXXXX";
+  int fd = mkstemp(name);
+  if(fd < 0) return -10;
+  close(fd);
+  int ret = 0;
+  struct dense_record *record = calloc(1, sizeof(*record));
+  if(!record) return -11;
+  COUNTUP(beat, BEATS) {
+    COUNTUP(c, 16) {
+      vec128b_set_zero(&record->notes[beat][c]);
+      vec128b_set_bit(&record->notes[beat][c], (beat + c) % 128);
+    }
+  }
+  scenes_init();
+  note_pages_reset();
+  uint32_t dropped = note_pages_dropped();
+  memset((char *)&state_test + sizeof(dtask_state_t), 0, sizeof(state_test) - sizeof(dtask_state_t));
+  if(!write_dense_state(name, &state_test, record)) ret = -12;
+  else if(!load_state(name, &state_test)) ret = -1;
+  else if(note_pages_dropped() != dropped || note_pages_in_use() != 16 * PAGES) ret = -2;
+  COUNTUP(beat, ret ? 0 : BEATS) {
+    COUNTUP(c, 16) {
+      if(!vec128b_bit_is_set(note_grid_get(&scenes[0].notes, c, beat), (beat + c) % 128)) ret = -3;
+    }
+  }
+  free(record);
+  scenes_init();
+  note_pages_reset();
+  unlink(name);
+  return ret;
+}
+
 #define WRITE_BYTES(fd, ...) write(fd, (unsigned char[]) { __VA_ARGS__ }, sizeof((unsigned char[]) { __VA_ARGS__ }))
 
 TEST(write_midi_file) {
@@ -530,6 +1199,8 @@ int write_midi_file(const char *path, const midi_tasks_state_t *state) {
   midi_state.beat.then = 0;
   midi_state.beat.now = 0;
   midi_state.playing = true;
+  midi_state.recording = false; // the record is shared, so don't modify it
+  midi_state.deleting = false;
 
   // tempo
   unsigned int tempo = 60000000 / midi_state.bpm;
@@ -540,12 +1211,12 @@ int write_midi_file(const char *path, const midi_tasks_state_t *state) {
 
   // set up tracks
   dtask_switch((dtask_state_t *)&midi_state, PLAYBACK | PLAYING);
-  dtask_run((dtask_state_t *)&midi_state, PLAYING);
+  midi_tasks_run_playing((dtask_state_t *)&midi_state);
 
   // playback to file
   COUNTUP(beat, BEATS) {
     _write_midi_file.current_beat = beat;
-    dtask_run((dtask_state_t *)&midi_state, EXTERNAL_TICK);
+    midi_tasks_run_external_tick((dtask_state_t *)&midi_state);
   }
 
   // end track
@@ -603,8 +1274,8 @@ void save(const midi_tasks_state_t *state) {
   printf("save MIDI: %s\n", filename);
 }
 
-STATIC_ALLOC(record, pair_t, 1 << 15);
 int main(int argc, char *argv[]) {
+  long long start_ms = time_ms();
   static_alloc_init();
   log_init();
 
@@ -622,11 +1293,15 @@ int main(int argc, char *argv[]) {
     }
 
     // get parameters
-    int curve = 1, threshold = 15;
+    int curve = 1, threshold = 15, window_ms = COALESCE_WINDOW_MS;
     if(argc >= 3) {
       curve = strtol(argv[1], NULL, 0);
       threshold = strtol(argv[2], NULL, 0);
     }
+    if(argc >= 4) {
+      window_ms = strtol(argv[3], NULL, 0);
+    }
+    coalesce_init(&push_coalesce, window_ms);
 
     // open devices
     int push_card = find_card("Ableton Push");
@@ -639,18 +1314,23 @@ int main(int argc, char *argv[]) {
     midi_open(&ext,   2, virtual_card, 1, ext_rb,   static_sizeof(ext_rb));
 
     // initialize Push
-    COUNTUP(i, sizeof(push_init)) {
-      char c = push_init[i];
-      int n = snd_rawmidi_write(push.out, &c, 1);
-      assert_throw(n >= 0, "Problem sending initialization: %s", snd_strerror(n));
-      if((unsigned char)c & 0x80) usleep(1000);
+    // the identity reply confirms the Push is listening before sending the rest
+    push_send(push_init, sizeof(push_init));
+    push_send(push_identity_request, sizeof(push_identity_request));
+    if(!push_wait_identity(PUSH_IDENTITY_TIMEOUT_MS)) {
+      printf("no identity reply from Push\n");
     }
+    push_send(push_setup, sizeof(push_setup));
     set_pad_curve(curve);
     set_pad_threshold(threshold);
 
     // load state
-    if(!load_state(STATE_FILE, &midi_state)) {
-      midi_state.record.events = init_map(record, record_size);
+    // if a bad state file couldn't be moved out of the way, save somewhere else
+    const char *state_file = STATE_FILE;
+    scenes_init();
+    if(!load_state(state_file, &midi_state) && access(state_file, F_OK) == 0) {
+      state_file = STATE_FILE ".new";
+      printf("state will be saved to: %s\n", state_file);
     }
 
     // collect poll fds
@@ -660,25 +1340,43 @@ int main(int argc, char *argv[]) {
 
     // enable and select tasks
     dtask_enable((dtask_state_t *)&midi_state, initial);
+    dtask_defer((dtask_state_t *)&midi_state, deferred);
     dtask_select((dtask_state_t *)&midi_state);
+    printf("ready in %lld ms\n", time_ms() - start_ms);
 
     // event loop
+    // everything read between polls, and the last tick, is a batch
     dtask_set_t events = 0;
     while(read_midi_msgs(&push,  &midi_state, &events) &&
           read_midi_msgs(&synth, &midi_state, &events) &&
           read_midi_msgs(&ext,   &midi_state, &events)) {
-      poll(pfds_in, pfds_in_n, 10);
-      gettimeofday(&midi_state.time_of_day, NULL);
-      events |= dtask_run((dtask_state_t *)&midi_state, TIME_OF_DAY);
+      flush_coalesced(&midi_state, &events, false);
+      events = dtask_run_deferred((dtask_state_t *)&midi_state, events);
       if(events & SAVE) {
         save(&midi_state);
       }
       events = 0;
+      poll(pfds_in, pfds_in_n, push_coalesce.pending ? push_coalesce.window_ms : 10);
+      gettimeofday(&midi_state.time_of_day, NULL);
+      events |= midi_tasks_run_time_of_day((dtask_state_t *)&midi_state);
+      // copy shared events before they're written, rather than in the tick
+      if(midi_state.recording || midi_state.deleting) scene_events_mut(midi_state.record.scene);
+      event_map_t *m = midi_state.record.scene->events;
+      if(event_map_maintain(m)) {
+        printf("record grown to %u events\n", m->size);
+      }
     }
 
+    printf("push input: %u messages, %u passed on\n", push_coalesce.in, push_coalesce.out);
+
+#ifdef DTASK_PROFILE
+    static const char *const task_names[] = MIDI_TASKS_TASK_NAMES;
+    dtask_profile_print((dtask_state_t *)&midi_state, task_names, MIDI_TASKS_COUNT);
+#endif
+
     // disable tasks, save state, and close
     dtask_disable((dtask_state_t *)&midi_state, initial);
-    save_state(STATE_FILE, &midi_state);
+    save_state(state_file, &midi_state);
     write_midi_file(MIDI_FILE, &midi_state);
 
     midi_close(&push);
@@ -733,3 +1431,180 @@ TEST(vec128b_shift) {
   }
   return 0;
 }
+
+static
+void vec128b_random(vec128b *v) {
+  FOREACH(i, v->word) {
+    v->word[i] = rand() ^ (unsigned int)rand() << 16;
+  }
+  // sparse and empty sets too
+  if(rand() % 4 == 0) vec128b_and_scalar(v, &(vec128b) {{ rand(), rand(), rand(), rand() }});
+  if(rand() % 8 == 0) vec128b_set_zero(v);
+}
+
+TEST(vec128b_simd) {
+#if VEC128B_SSE2
+  printf("SIMD: SSE2\n");
+#elif VEC128B_NEON
+  printf("SIMD: NEON\n");
+#else
+  printf("SIMD: none\n");
+#endif
+  srand(3);
+  LOOP(1000) {
+    vec128b a, b, x, y;
+    vec128b_random(&a);
+    vec128b_random(&b);
+    if(rand() % 4 == 0) b = a;
+
+#define CHECK_OP(op, ...)                               \
+    x = a; y = a;                                       \
+    vec128b_##op(&x, ##__VA_ARGS__);                    \
+    vec128b_##op##_scalar(&y, ##__VA_ARGS__);           \
+    if(memcmp(&x, &y, sizeof(x)) != 0) {                \
+      printf(#op " differs\n");                         \
+      vec128b_print(&a);                                \
+      return -1;                                        \
+    }
+    CHECK_OP(and, &b);
+    CHECK_OP(and_not, &b);
+    CHECK_OP(or, &b);
+    CHECK_OP(xor, &b);
+    CHECK_OP(not);
+    RANGEUP(n, 0, 129) {
+      CHECK_OP(shiftl, n);
+      CHECK_OP(shiftr, n);
+    }
+#undef CHECK_OP
+    if(vec128b_eq(&a, &b) != vec128b_eq_scalar(&a, &b) ||
+       vec128b_zero(&a) != vec128b_zero_scalar(&a)) return -2;
+  }
+  return 0;
+}
+
+TEST(vec128b_bits) {
+  srand(5);
+  LOOP(1000) {
+    vec128b v;
+    vec128b_random(&v);
+    int n = 0, first = -1, last = -1;
+    COUNTUP(i, 128) {
+      if(vec128b_bit_is_set(&v, i)) {
+        if(first < 0) first = i;
+        last = i;
+        n++;
+      }
+    }
+    if(vec128b_popcount(&v) != n ||
+       vec128b_first_set(&v) != first ||
+       vec128b_last_set(&v) != last) return -1;
+    int prev = -1;
+    vec128b_foreach_set(i, &v) {
+      if(i <= prev || !vec128b_bit_is_set(&v, i)) return -2;
+      prev = i;
+      n--;
+    }
+    if(n) return -3;
+  }
+  return 0;
+}
+
+TEST(beat_frame) {
+#if BEAT_FRAME_AVX2
+  printf("beat frame: AVX2\n");
+#endif
+  srand(6);
+  LOOP(1000) {
+    beat_frame_t a, b, x;
+    vec128b all = {{0}}, all_x;
+    unsigned int mask = rand() & 0xffff, nonzero = 0;
+    COUNTUP(c, BEAT_FRAME_CHANNELS) {
+      vec128b_random(&a.ch[c]);
+      vec128b_random(&b.ch[c]);
+    }
+    vec128b_random(&all);
+    all_x = all;
+
+    x = a;
+    beat_frame_or(&x, &b);
+    COUNTUP(c, BEAT_FRAME_CHANNELS) {
+      vec128b t = a.ch[c];
+      vec128b_or_scalar(&t, &b.ch[c]);
+      if(!vec128b_eq_scalar(&t, &x.ch[c])) return -1;
+    }
+
+    x = a;
+    beat_frame_and_not(&x, &b);
+    beat_frame_mask(&x, mask);
+    COUNTUP(c, BEAT_FRAME_CHANNELS) {
+      vec128b t = a.ch[c];
+      vec128b_and_not_scalar(&t, &b.ch[c]);
+      if(!(mask & 1u << c)) vec128b_set_zero(&t);
+      if(!vec128b_eq_scalar(&t, &x.ch[c])) return -2;
+      if(!vec128b_zero_scalar(&t)) nonzero |= 1u << c;
+    }
+    if(beat_frame_nonzero(&x) != nonzero) return -3;
+
+    beat_frame_reduce(&a, mask, &all_x);
+    COUNTUP(c, BEAT_FRAME_CHANNELS) {
+      if(mask & 1u << c) vec128b_or_scalar(&all, &a.ch[c]);
+    }
+    if(!vec128b_eq_scalar(&all, &all_x)) return -4;
+  }
+  return 0;
+}
+
+// the vector work done each tick by playback and show_playback, and building a transposed copy page
+#define VEC128B_BENCH_BODY(S)                                           \
+  unsigned int cnt = 0;                                                 \
+  COUNTUP(b, BEATS_PER_PAGE) {                                          \
+    vec128b all = extra[0];                                             \
+    COUNTUP(c, 16) {                                                    \
+      vec128b pressed = grid[b][c];                                     \
+      vec128b_or##S(&pressed, &extra[c]);                               \
+      vec128b_or##S(&all, &pressed);                                    \
+      vec128b released = played[c];                                     \
+      vec128b_and_not##S(&released, &pressed);                          \
+      if(!vec128b_zero##S(&released)) cnt++;                            \
+      if(!vec128b_eq##S(&played[c], &pressed)) played[c] = pressed;     \
+      vec128b t = grid[b][c];                                           \
+      if(transpose > 0) {                                               \
+        vec128b_shiftl##S(&t, transpose);                               \
+      } else {                                                          \
+        vec128b_shiftr##S(&t, -transpose);                              \
+      }                                                                 \
+      cnt += t.word[c & 3] & 1;                                         \
+    }                                                                   \
+    cnt += all.word[b & 3] & 1;                                         \
+  }                                                                     \
+  return cnt;
+
+static
+unsigned int vec128b_bench(vec128b (*grid)[16], vec128b *extra, vec128b *played, int transpose) {
+  VEC128B_BENCH_BODY()
+}
+
+static
+unsigned int vec128b_bench_scalar(vec128b (*grid)[16], vec128b *extra, vec128b *played, int transpose) {
+  VEC128B_BENCH_BODY(_scalar)
+}
+
+TEST(vec128b_bench) {
+  static vec128b grid[BEATS_PER_PAGE][16], extra[16], played[2][16];
+  const int loops = 2000;
+  srand(4);
+  COUNTUP(b, BEATS_PER_PAGE) {
+    COUNTUP(c, 16) {
+      vec128b_random(&grid[b][c]);
+    }
+  }
+  COUNTUP(c, 16) vec128b_random(&extra[c]);
+  unsigned int cnt[2] = {0};
+  long long t0 = time_ns();
+  COUNTUP(i, loops) cnt[0] += vec128b_bench(grid, extra, played[0], (int)(i % 25) - 12);
+  long long t1 = time_ns();
+  COUNTUP(i, loops) cnt[1] += vec128b_bench_scalar(grid, extra, played[1], (int)(i % 25) - 12);
+  long long t2 = time_ns();
+  printf("SIMD %lld ns/page, scalar %lld ns/page\n", (t1 - t0) / loops, (t2 - t1) / loops);
+  return cnt[0] == cnt[1] ? 0 : -1;
+}
@@ -0,0 +1,500 @@
+/* Copyright 2020-2021 Dustin DeWeese
+   This file is part of MidiPush.
+
+    MidiPush is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    MidiPush is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with MidiPush.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "types.h"
+#include "startle/types.h"
+#include "startle/macros.h"
+#include "startle/support.h"
+#include "startle/test.h"
+
+#include "vec128b.h"
+#include "note_grid.h"
+
+// Held notes are stored a page (BEATS_PER_PAGE beats) at a time for each channel.
+// Pages are only allocated when written, and all empty pages share page 0,
+// so memory and saved state scale with the recorded content.
+// The pool is left to the OS to zero, so unused pages are never touched.
+// Pages can be shared between grids, and are copied on the first write.
+// Each grid also keeps occupancy summaries, one bit per beat and one per page
+// for each channel, so scans can skip empty regions.
+
+#if INTERFACE
+#define NOTE_PAGE_EMPTY 0
+
+// enough for eight scenes with notes on every page, the rest shared or held for undo
+#ifndef NOTE_PAGES
+#define NOTE_PAGES (16 * PAGES * 8)
+#endif
+
+typedef struct note_page {
+  vec128b beat[BEATS_PER_PAGE];
+} note_page_t;
+
+typedef struct note_grid {
+  uint16_t page[16][PAGES]; // index into note_pages
+  uint32_t beats[16][PAGES]; // beats with notes held, bit per beat in the page
+  uint64_t pages[16]; // pages with notes held, bit per page
+} note_grid_t;
+#endif
+
+#if PAGES > 64 || BEATS_PER_PAGE > 32
+#error "note_grid summaries don't fit"
+#endif
+
+#if NOTE_PAGES > 65536
+#error "note page indices don't fit"
+#endif
+
+note_page_t note_pages[NOTE_PAGES];
+uint16_t note_page_refs[NOTE_PAGES]; // zero if free, page 0 is never freed or written
+
+static size_t note_pages_used = 0;
+static size_t note_page_hint = 1;
+static uint32_t note_pages_failed = 0; // writes dropped for lack of a free page
+
+// free all pages
+void note_pages_reset() {
+  RANGEUP(i, 1, NOTE_PAGES) {
+    if(note_page_refs[i]) {
+      memset(&note_pages[i], 0, sizeof(note_pages[i]));
+      note_page_refs[i] = 0;
+    }
+  }
+  note_pages_used = 0;
+  note_page_hint = 1;
+}
+
+size_t note_pages_in_use() {
+  return note_pages_used;
+}
+
+// number of writes dropped because there were no free pages
+uint32_t note_pages_dropped() {
+  return note_pages_failed;
+}
+
+static
+unsigned int note_page_alloc() {
+  RANGEUP(i, 1, NOTE_PAGES) {
+    size_t p = note_page_hint;
+    note_page_hint = note_page_hint + 1 < NOTE_PAGES ? note_page_hint + 1 : 1;
+    if(!note_page_refs[p]) {
+      note_page_refs[p] = 1;
+      note_pages_used++;
+      return p;
+    }
+  }
+  note_pages_failed++;
+  return NOTE_PAGE_EMPTY;
+}
+
+static
+void note_page_free(unsigned int p) {
+  if(p != NOTE_PAGE_EMPTY && !--note_page_refs[p]) {
+    memset(&note_pages[p], 0, sizeof(note_pages[p]));
+    note_pages_used--;
+  }
+}
+
+// make sure the page isn't shared before writing to it
+// returns false if there are no free pages
+static
+bool note_page_own(uint16_t *p) {
+  if(note_page_refs[*p] <= 1) return true;
+  unsigned int q = note_page_alloc();
+  if(q == NOTE_PAGE_EMPTY) return false;
+  note_pages[q] = note_pages[*p];
+  note_page_refs[*p]--;
+  *p = q;
+  return true;
+}
+
+// notes held at the beat, read only
+const vec128b *note_grid_get(const note_grid_t *g, unsigned int channel, unsigned int beat) {
+  return &note_pages[g->page[channel][beat / BEATS_PER_PAGE]].beat[beat % BEATS_PER_PAGE];
+}
+
+// writable notes at the beat, allocating the page if needed
+// returns NULL if there are no free pages
+static
+vec128b *note_grid_mut(note_grid_t *g, unsigned int channel, unsigned int beat) {
+  uint16_t *p = &g->page[channel][beat / BEATS_PER_PAGE];
+  if(*p == NOTE_PAGE_EMPTY) {
+    *p = note_page_alloc();
+    if(*p == NOTE_PAGE_EMPTY) return NULL;
+  } else if(!note_page_own(p)) {
+    return NULL;
+  }
+  return &note_pages[*p].beat[beat % BEATS_PER_PAGE];
+}
+
+bool note_grid_or(note_grid_t *g, unsigned int channel, unsigned int beat, const vec128b *v) {
+  if(vec128b_zero(v)) return true;
+  vec128b *n = note_grid_mut(g, channel, beat);
+  if(!n) return false;
+  vec128b_or(n, v);
+  unsigned int p = beat / BEATS_PER_PAGE;
+  g->beats[channel][p] |= 1u << (beat % BEATS_PER_PAGE);
+  g->pages[channel] |= 1ull << p;
+  return true;
+}
+
+void note_grid_and_not(note_grid_t *g, unsigned int channel, unsigned int beat, const vec128b *v) {
+  unsigned int i = beat / BEATS_PER_PAGE, b = beat % BEATS_PER_PAGE;
+  uint16_t *p = &g->page[channel][i];
+  if(*p == NOTE_PAGE_EMPTY) return;
+  vec128b n = note_pages[*p].beat[b];
+  vec128b_and_not(&n, v);
+  if(vec128b_eq(&n, &note_pages[*p].beat[b])) return;
+  uint32_t beats = g->beats[channel][i];
+  if(vec128b_zero(&n)) beats &= ~(1u << b);
+  if(!beats) { // drop the page without copying it
+    g->beats[channel][i] = 0;
+    g->pages[channel] &= ~(1ull << i);
+    note_page_free(*p);
+    *p = NOTE_PAGE_EMPTY;
+    return;
+  }
+  if(!note_page_own(p)) return;
+  note_pages[*p].beat[b] = n;
+  g->beats[channel][i] = beats;
+}
+
+void note_grid_clear_channel(note_grid_t *g, unsigned int channel) {
+  uint64_t pages = g->pages[channel];
+  while(pages) {
+    unsigned int i = __builtin_ctzll(pages);
+    note_page_free(g->page[channel][i]);
+    g->page[channel][i] = NOTE_PAGE_EMPTY;
+    pages &= pages - 1;
+  }
+  memset(g->beats[channel], 0, sizeof(g->beats[channel]));
+  g->pages[channel] = 0;
+}
+
+void note_grid_clear(note_grid_t *g) {
+  COUNTUP(c, 16) {
+    note_grid_clear_channel(g, c);
+  }
+}
+
+// replace dst with src, sharing its pages
+void note_grid_copy(note_grid_t *dst, const note_grid_t *src) {
+  if(dst == src) return;
+  note_grid_clear(dst);
+  *dst = *src;
+  COUNTUP(c, 16) {
+    uint64_t pages = dst->pages[c];
+    while(pages) {
+      note_page_refs[dst->page[c][__builtin_ctzll(pages)]]++;
+      pages &= pages - 1;
+    }
+  }
+}
+
+bool note_grid_beat_occupied(const note_grid_t *g, unsigned int channel, unsigned int beat) {
+  return g->beats[channel][beat / BEATS_PER_PAGE] >> (beat % BEATS_PER_PAGE) & 1;
+}
+
+// pages with notes held on any of the channels
+uint64_t note_grid_pages(const note_grid_t *g, unsigned int channels) {
+  uint64_t pages = 0;
+  COUNTUP(c, 16) {
+    if(channels & 1u << c) pages |= g->pages[c];
+  }
+  return pages;
+}
+
+// channels with any notes held
+unsigned int note_grid_channels(const note_grid_t *g) {
+  unsigned int channels = 0;
+  COUNTUP(c, 16) {
+    if(g->pages[c]) channels |= 1u << c;
+  }
+  return channels;
+}
+
+static
+uint32_t page_beats(const note_grid_t *g, unsigned int channels, unsigned int p) {
+  uint32_t beats = 0;
+  COUNTUP(c, 16) {
+    if(channels & 1u << c) beats |= g->beats[c][p];
+  }
+  return beats;
+}
+
+// first beat at or after the given beat, wrapping around, with notes held on any of the channels
+// returns -1 if there are none
+int note_grid_next_beat(const note_grid_t *g, unsigned int channels, unsigned int beat) {
+  unsigned int first = beat / BEATS_PER_PAGE;
+  uint32_t after = ~0u << (beat % BEATS_PER_PAGE);
+  uint64_t pages = note_grid_pages(g, channels);
+  if(!pages) return -1;
+
+  // the rest of the first page
+  uint32_t beats = page_beats(g, channels, first);
+  if(beats & after) return first * BEATS_PER_PAGE + __builtin_ctz(beats & after);
+
+  // rotate so that the page after the first is bit 0
+  unsigned int r = (first + 1) % PAGES;
+  uint64_t rest = r ? pages >> r | pages << (PAGES - r) : pages;
+#if PAGES < 64
+  rest &= (1ull << PAGES) - 1;
+#endif
+  while(rest) {
+    unsigned int p = (r + __builtin_ctzll(rest)) % PAGES;
+    beats = page_beats(g, channels, p);
+    if(p == first) beats &= ~after; // wrapped around
+    if(beats) return p * BEATS_PER_PAGE + __builtin_ctz(beats);
+    rest &= rest - 1;
+  }
+  return -1;
+}
+
+// beats in the page where the note is held, bit per beat
+static
+uint32_t note_page_beats(const note_grid_t *g, unsigned int channel, unsigned int note, unsigned int p) {
+  uint32_t beats = g->beats[channel][p], held = 0;
+  const note_page_t *page = &note_pages[g->page[channel][p]];
+  while(beats) {
+    unsigned int b = __builtin_ctz(beats);
+    if(vec128b_bit_is_set(&page->beat[b], note)) held |= 1u << b;
+    beats &= beats - 1;
+  }
+  return held;
+}
+
+#define PAGE_BEATS_MASK (~0u >> (32 - BEATS_PER_PAGE))
+
+// the run of beats holding the note that includes the beat, wrapping within the first len beats,
+// where len is a whole number of pages
+// returns the length of the run and sets *first to where it starts, or returns 0 if the note isn't held
+unsigned int note_grid_span(const note_grid_t *g, unsigned int channel, unsigned int note,
+                            unsigned int beat, unsigned int len, unsigned int *first) {
+  unsigned int pages = len / BEATS_PER_PAGE;
+  unsigned int p = beat / BEATS_PER_PAGE, b = beat % BEATS_PER_PAGE;
+  uint32_t held = note_page_beats(g, channel, note, p);
+  if(!(held >> b & 1)) return 0;
+
+  // forward to the first beat without the note, a page at a time
+  unsigned int n = 0, q = p;
+  uint32_t gaps = ~held & PAGE_BEATS_MASK & (~0u << b);
+  while(!gaps) {
+    n += BEATS_PER_PAGE;
+    q = q + 1 < pages ? q + 1 : 0;
+    if(n - b >= len) { // the whole loop
+      *first = 0;
+      return len;
+    }
+    gaps = ~note_page_beats(g, channel, note, q) & PAGE_BEATS_MASK;
+  }
+  unsigned int end = n + __builtin_ctz(gaps); // relative to the start of page p
+
+  // back to the last beat without the note
+  n = 0;
+  q = p;
+  gaps = ~held & PAGE_BEATS_MASK & ~(~0u << b);
+  while(!gaps) {
+    n += BEATS_PER_PAGE;
+    q = q ? q - 1 : pages - 1;
+    gaps = ~note_page_beats(g, channel, note, q) & PAGE_BEATS_MASK;
+  }
+  int start = (int)(32 - __builtin_clz(gaps)) - (int)n; // relative to the start of page p
+  *first = (p * BEATS_PER_PAGE + len + start) % len;
+  return end - start;
+}
+
+// set or clear the note over n beats from the first, wrapping within the first len beats
+void note_grid_set_span(note_grid_t *g, unsigned int channel, unsigned int note,
+                        unsigned int first, unsigned int n, unsigned int len, bool on) {
+  vec128b v;
+  vec128b_set_zero(&v);
+  vec128b_set_bit(&v, note);
+  unsigned int beat = first;
+  LOOP(n) {
+    if(on) {
+      note_grid_or(g, channel, beat, &v);
+    } else {
+      note_grid_and_not(g, channel, beat, &v);
+    }
+    beat = beat + 1 < len ? beat + 1 : 0;
+  }
+}
+
+// page to load saved contents into, NULL if the index is invalid
+note_page_t *note_page_load(unsigned int p) {
+  if(p == NOTE_PAGE_EMPTY || p >= NOTE_PAGES) return NULL;
+  note_page_refs[p] = 1; // so note_pages_reset() will clear it
+  return &note_pages[p];
+}
+
+// rebuild reference counts after loading pages,
+// by calling this and then note_grid_add_refs() for each grid
+void note_page_refs_reset() {
+  note_pages_used = 0;
+  RANGEUP(i, 1, NOTE_PAGES) note_page_refs[i] = 0;
+}
+
+// then clear loaded pages that nothing refers to with note_pages_sweep()
+// returns false if the grid refers to a page that doesn't exist
+bool note_grid_add_refs(const note_grid_t *g) {
+  COUNTUP(c, 16) {
+    COUNTUP(i, PAGES) {
+      if(g->page[c][i] >= NOTE_PAGES) return false;
+    }
+  }
+  COUNTUP(c, 16) {
+    COUNTUP(i, PAGES) {
+      unsigned int p = g->page[c][i];
+      if(p != NOTE_PAGE_EMPTY && !note_page_refs[p]++) note_pages_used++;
+    }
+  }
+  return true;
+}
+
+// clear free pages, which must be zero to be allocated, after rebuilding the reference counts
+// pages that were never written are only read
+void note_pages_sweep() {
+  RANGEUP(i, 1, NOTE_PAGES) {
+    if(note_page_refs[i]) continue;
+    COUNTUP(b, BEATS_PER_PAGE) {
+      if(!vec128b_zero(&note_pages[i].beat[b])) {
+        memset(&note_pages[i], 0, sizeof(note_pages[i]));
+        break;
+      }
+    }
+  }
+}
+
+// rebuild the summaries from loaded pages, for grids saved without them
+// empty pages are dropped, and invalid indices are left for note_grid_add_refs() to reject
+void note_grid_summarize(note_grid_t *g) {
+  COUNTUP(c, 16) {
+    g->pages[c] = 0;
+    COUNTUP(i, PAGES) {
+      unsigned int p = g->page[c][i];
+      uint32_t beats = 0;
+      if(p < NOTE_PAGES) {
+        COUNTUP(b, BEATS_PER_PAGE) {
+          if(!vec128b_zero(&note_pages[p].beat[b])) beats |= 1u << b;
+        }
+        if(!beats) g->page[c][i] = NOTE_PAGE_EMPTY;
+      }
+      g->beats[c][i] = beats;
+      if(beats) g->pages[c] |= 1ull << i;
+    }
+  }
+}
+
+TEST(note_grid) {
+  static note_grid_t g;
+  vec128b v;
+  vec128b_set_zero(&v);
+  vec128b_set_bit(&v, 60);
+  note_pages_reset();
+  if(!vec128b_zero(note_grid_get(&g, 3, 100))) return -1;
+  COUNTUP(b, BEATS_PER_PAGE + 1) {
+    note_grid_or(&g, 3, 100 + b, &v);
+  }
+  if(note_pages_in_use() != 2) return -2;
+  if(!vec128b_bit_is_set(note_grid_get(&g, 3, 110), 60)) return -3;
+  if(!vec128b_zero(note_grid_get(&g, 4, 110))) return -4;
+  if(note_grid_channels(&g) != 1u << 3) return -7;
+  if(note_grid_pages(&g, 1u << 3) != (3ull << (100 / BEATS_PER_PAGE))) return -8;
+  if(note_grid_next_beat(&g, 0xffff, 0) != 100) return -9;
+  if(note_grid_next_beat(&g, 0xffff, 110) != 110) return -10;
+  if(note_grid_next_beat(&g, 0xffff, 130) != 100) return -11; // wraps
+  if(note_grid_next_beat(&g, 1u << 4, 0) != -1) return -12;
+  note_grid_and_not(&g, 3, 110, &v);
+  if(note_grid_beat_occupied(&g, 3, 110) ||
+     !note_grid_beat_occupied(&g, 3, 111)) return -13;
+  COUNTUP(b, BEATS_PER_PAGE + 1) {
+    note_grid_and_not(&g, 3, 100 + b, &v);
+  }
+  if(note_pages_in_use() != 0) return -5;
+
+  // spans, wrapping around a two page loop
+  unsigned int first, len = 2 * BEATS_PER_PAGE;
+  RANGEUP(b, 10, 30) note_grid_or(&g, 6, b, &v);
+  if(note_grid_span(&g, 6, 60, 25, len, &first) != 20 || first != 10) return -19;
+  if(note_grid_span(&g, 6, 61, 25, len, &first) != 0) return -20;
+  RANGEUP(b, 40, len) note_grid_or(&g, 6, b, &v);
+  RANGEUP(b, 0, 5) note_grid_or(&g, 6, b, &v);
+  if(note_grid_span(&g, 6, 60, 2, len, &first) != 13 || first != 40) return -21;
+  note_grid_set_span(&g, 6, 60, first, 13, len, false);
+  if(note_grid_beat_occupied(&g, 6, 47) || note_grid_beat_occupied(&g, 6, 4) ||
+     !note_grid_beat_occupied(&g, 6, 10)) return -22;
+  note_grid_set_span(&g, 6, 60, 30, 10, len, true);
+  if(note_grid_span(&g, 6, 60, 0, len, &first) != 0 ||
+     note_grid_span(&g, 6, 60, 39, len, &first) != 30 || first != 10) return -23;
+  note_grid_set_span(&g, 6, 60, 0, len, len, true);
+  if(note_grid_span(&g, 6, 60, 7, len, &first) != len) return -24;
+  note_grid_clear_channel(&g, 6);
+
+  note_grid_or(&g, 5, 0, &v);
+  note_grid_clear(&g);
+  if(note_pages_in_use() != 0) return -6;
+
+  // copy on write
+  static note_grid_t h;
+  note_grid_or(&g, 5, 0, &v);
+  note_grid_copy(&h, &g);
+  if(note_pages_in_use() != 1) return -14;
+  vec128b_set_bit(&v, 61);
+  note_grid_or(&h, 5, 1, &v);
+  if(note_pages_in_use() != 2) return -15;
+  if(vec128b_bit_is_set(note_grid_get(&g, 5, 1), 61)) return -16;
+  note_grid_and_not(&g, 5, 0, &v); // drops the shared page without copying
+  if(note_pages_in_use() != 1 || !note_grid_beat_occupied(&h, 5, 0)) return -17;
+  note_grid_clear(&h);
+  if(note_pages_in_use() != 0) return -18;
+  return 0;
+}
+
+// writes that find no free page are counted, and loaded pages nothing refers to are cleared
+TEST(note_pages_full) {
+  static note_grid_t g[NOTE_PAGES / (16 * PAGES) + 1];
+  vec128b v;
+  vec128b_set_zero(&v);
+  vec128b_set_bit(&v, 60);
+  note_pages_reset();
+  uint32_t dropped = note_pages_dropped();
+  unsigned int stored = 0;
+  FOREACH(i, g) {
+    COUNTUP(c, 16) {
+      COUNTUP(p, PAGES) {
+        if(note_grid_or(&g[i], c, p * BEATS_PER_PAGE, &v)) stored++;
+      }
+    }
+  }
+  if(stored != NOTE_PAGES - 1 || note_pages_dropped() - dropped != LENGTH(g) * 16 * PAGES - stored) return -1;
+  FOREACH(i, g) note_grid_clear(&g[i]);
+  if(note_pages_in_use() != 0) return -2;
+
+  note_page_t *page = note_page_load(5);
+  page->beat[3] = v;
+  note_page_refs_reset();
+  FOREACH(i, g) note_grid_add_refs(&g[i]);
+  note_pages_sweep();
+  if(!vec128b_zero(&note_pages[5].beat[3]) || note_pages_in_use() != 0) return -3;
+  return 0;
+}
@@ -0,0 +1,245 @@
+/* Copyright 2020-2021 Dustin DeWeese
+   This file is part of MidiPush.
+
+    MidiPush is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    MidiPush is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with MidiPush.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "types.h"
+#include "startle/types.h"
+#include "startle/macros.h"
+#include "startle/support.h"
+#include "startle/test.h"
+
+#include "scale.h"
+
+// Scale inference scores each of the 12 major scales by convolving a filter
+// over the pitch classes of the latest note ons.
+// The score only depends on the set of pitch classes, so the best scale for each of the
+// 4096 sets is precomputed, along with whether a set of three matches a chord.
+// The set is kept in order of the latest note on of each pitch class,
+// so finding it doesn't need to walk the history.
+
+#if INTERFACE
+#define SCALE_CLASSES 7 // most pitch classes considered
+
+typedef struct scale_entry {
+  uint8_t best; // highest scoring scale, the lowest on ties
+  int8_t score; // its score
+  bool chord;   // three pitch classes that match a chord
+} scale_entry_t;
+
+// pitch classes of the latest note ons in the current_note history
+typedef struct pitch_history {
+  unsigned int seq;  // entries written
+  unsigned int end;  // seq of the latest entry that ends the history
+  unsigned int on[12]; // seq of the latest note on of each pitch class
+  uint8_t order[12]; // pitch classes, latest note on first
+} pitch_history_t;
+#endif
+
+// simple fixed point representation
+#define F(x) (4*(x))
+static const int8_t scale_filter[12] = { // convolution filter in fixed point
+   F(2.5),   F(-1),  F(1), F(-1),
+  F(2.25),    F(1), F(-1),  F(2),
+    F(-1), F(1.25), F(-1),  F(1)
+};
+static const int8_t scale_chord = F(6.75); // f[0] + f[4] + f[7], a major chord
+static const int8_t scale_bias = F(0.5); // f[0] - f[4], so that repeated 4 or 7 won't switch
+#undef F
+
+static scale_entry_t scale_table[1 << 12];
+static bool scale_table_built = false;
+
+// score of the scale for the set of pitch classes
+static
+int score(unsigned int set, unsigned int scale) {
+  int c = 0;
+  while(set) {
+    unsigned int s = __builtin_ctz(set);
+    set &= set - 1;
+    c += scale_filter[(12 + s - scale) % 12];
+  }
+  return c;
+}
+
+void scale_table_init() {
+  if(scale_table_built) return;
+  COUNTUP(set, LENGTH(scale_table)) {
+    scale_entry_t *t = &scale_table[set];
+    int c_max = score(set, 0);
+    t->best = 0;
+    t->chord = false;
+    COUNTUP(j, 12) {
+      int c = score(set, j);
+      if(c > c_max) {
+        c_max = c;
+        t->best = j;
+      }
+      if(c >= scale_chord) t->chord = true;
+    }
+    t->score = c_max;
+  }
+  scale_table_built = true;
+}
+
+void pitch_history_init(pitch_history_t *h) {
+  memset(h, 0, sizeof(*h));
+  COUNTUP(i, 12) h->order[i] = i;
+}
+
+// follow a write to the current_note history
+void pitch_history_add(pitch_history_t *h, int id, int velocity) {
+  h->seq++;
+  if(id <= 0) {
+    h->end = h->seq;
+    return;
+  }
+  if(velocity <= 0) return;
+  unsigned int s = id % 12, i = 0;
+  h->on[s] = h->seq;
+  while(h->order[i] != s) i++;
+  memmove(&h->order[1], &h->order[0], i);
+  h->order[0] = s;
+}
+
+// the set of the latest pitch classes, up to SCALE_CLASSES, or three if they match a chord
+unsigned int pitch_history_set(const pitch_history_t *h, unsigned int *cnt) {
+  unsigned int set = 0, n = 0;
+  COUNTUP(i, SCALE_CLASSES) {
+    unsigned int s = h->order[i], age = h->seq - h->on[s];
+    if(age >= HISTORY || age >= h->seq - h->end) break;
+    set |= 1u << s;
+    if(++n == 3 && scale_table[set].chord) break;
+  }
+  *cnt = n;
+  return set;
+}
+
+// the best scale for the set of cnt pitch classes, biased towards the previous scale
+int scale_infer(unsigned int set, unsigned int cnt, int prev) {
+  const scale_entry_t *t = &scale_table[set];
+  if(t->best == prev) return prev;
+  return t->score > score(set, prev) + (int)cnt * scale_bias ? t->best : prev;
+}
+
+// the previous implementation, walking the history (latest first) for each note on
+static
+int scale_infer_reference(const key_event_t *history, int prev_scale) {
+  int c[12] = {0};
+  int cnt = 0;
+  int set = 0;
+  for(int i = 0; i < HISTORY && cnt < SCALE_CLASSES; i++) {
+    const key_event_t *e = &history[i];
+    if(e->id <= 0) break;
+    if(e->velocity <= 0) continue;
+    int s = e->id % 12;
+    int bit = 1 << s;
+    if(!(set & bit)) {
+      cnt++;
+      set |= bit;
+      bool done = false;
+      COUNTUP(j, 12) {
+        c[j] += scale_filter[(12 + s - j) % 12];
+        if(cnt == 3 && c[j] >= scale_chord) {
+          done = true; // matched a chord, finish
+        }
+      }
+      if(done) break;
+    }
+  }
+  c[prev_scale] += cnt * scale_bias;
+  int c_max = c[prev_scale], c_i = prev_scale;
+  COUNTUP(i, 12) {
+    if(c[i] > c_max) {
+      c_max = c[i];
+      c_i = i;
+    }
+  }
+  return c_i;
+}
+
+// random notes, mostly from a scale that changes now and then, with chords and note offs
+static
+key_event_t scale_random_note(int *key) {
+  static const int major[7] = { 0, 2, 4, 5, 7, 9, 11 };
+  if(rand() % 40 == 0) *key = rand() % 12;
+  key_event_t e = {
+    .id = 36 + *key + major[rand() % 7] + 12 * (rand() % 3),
+    .velocity = rand() % 3 ? 1 + rand() % 127 : 0
+  };
+  if(rand() % 10 == 0) e.id = 36 + rand() % 48;
+  if(rand() % 500 == 0) e.id = 0;
+  return e;
+}
+
+TEST(scale) {
+  scale_table_init();
+  srand(3);
+  static key_event_t notes[20000];
+  int key = 0;
+  COUNTUP(i, LENGTH(notes)) notes[i] = scale_random_note(&key);
+
+  // the same scale as the previous implementation after every note
+  key_event_t history[HISTORY];
+  pitch_history_t h;
+  pitch_history_init(&h);
+  COUNTUP(i, HISTORY) {
+    history[i] = (key_event_t) { -1, 0 };
+    pitch_history_add(&h, -1, 0);
+  }
+  int prev = 0, changes = 0;
+  COUNTUP(i, LENGTH(notes)) {
+    memmove(&history[1], &history[0], sizeof(history) - sizeof(history[0]));
+    history[0] = notes[i];
+    pitch_history_add(&h, notes[i].id, notes[i].velocity);
+    if(notes[i].velocity <= 0) continue;
+    unsigned int cnt, set = pitch_history_set(&h, &cnt);
+    COUNTUP(p, 12) { // from any previous scale
+      if(scale_infer(set, cnt, p) != scale_infer_reference(history, p)) return -1;
+    }
+    int expected = scale_infer_reference(history, prev);
+    int s = scale_infer(set, cnt, prev);
+    if(s != expected) {
+      printf("note %d: scale %d, expected %d\n", (int)i, s, expected);
+      return -2;
+    }
+    if(s != prev) changes++;
+    prev = s;
+  }
+  printf("%d scale changes over %d notes\n", changes, (int)LENGTH(notes));
+
+  // time per note
+  long long t0 = time_ns();
+  int x = 0;
+  COUNTUP(i, LENGTH(notes) - HISTORY) {
+    x += scale_infer_reference(&notes[i], x % 12);
+  }
+  long long t1 = time_ns();
+  COUNTUP(i, LENGTH(notes)) {
+    pitch_history_add(&h, notes[i].id, notes[i].velocity);
+    unsigned int cnt, set = pitch_history_set(&h, &cnt);
+    x += scale_infer(set, cnt, x % 12);
+  }
+  long long t2 = time_ns();
+  printf("per note: history walk %lld ns, table %lld ns (%d)\n",
+         (t1 - t0) / (long long)LENGTH(notes), (t2 - t1) / (long long)LENGTH(notes), x % 12);
+  return 0;
+}
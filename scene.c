@@ -0,0 +1,280 @@
+/* Copyright 2020-2021 Dustin DeWeese
+   This file is part of MidiPush.
+
+    MidiPush is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    MidiPush is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with MidiPush.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "types.h"
+#include "startle/types.h"
+#include "startle/macros.h"
+#include "startle/support.h"
+#include "startle/test.h"
+
+#include "vec128b.h"
+#include "note_grid.h"
+#include "event_map.h"
+#include "scene.h"
+#include "journal.h"
+
+// Each scene is a complete record: held notes and events.
+// Copying a scene shares everything; note pages are copied when first written,
+// and the event map is copied as a whole when first written,
+// which the main loop does for the current scene before recording into it.
+// The record points at the current scene, so switching scenes copies nothing.
+
+#if INTERFACE
+#define SCENES 16
+
+typedef struct scene {
+  note_grid_t notes;
+  event_map_t *events;
+} scene_t;
+
+// events held by an image, a page with more is read from its scene instead
+#ifndef SCENE_IMAGE_EVENTS
+#define SCENE_IMAGE_EVENTS 1024
+#endif
+
+// a page of a scene, with each channel wrapped to its loop and the notes transposed
+typedef struct scene_image {
+  int page, transpose; // source page, -1 if invalid
+  const scene_t *scene;
+  unsigned int len[16];
+  unsigned int channel_page[16]; // the page of each channel's loop that's cached
+  bool direct; // the events didn't fit, so they're read from the scene
+  vec128b notes[BEATS_PER_PAGE][16];
+  uint16_t start[BEATS_PER_PAGE * 16 + 1]; // events for each beat and channel
+  event_t event[SCENE_IMAGE_EVENTS];
+} scene_image_t;
+#endif
+
+scene_t scenes[SCENES];
+
+// release a scene's contents, leaving it empty with no events
+void scene_free(scene_t *s) {
+  note_grid_clear(&s->notes);
+  event_map_release(s->events);
+  s->events = NULL;
+}
+
+void scenes_free() {
+  journal_clear(); // refers to scenes by index
+  FOREACH(i, scenes) {
+    scene_free(&scenes[i]);
+  }
+}
+
+// empty all scenes, sharing a single empty event map
+bool scenes_init() {
+  scenes_free();
+  event_map_t *m = event_map_new(EVENT_MAP_MAX_SIZE);
+  if(!m) return false;
+  event_map_reserve(m, EVENT_MAP_MIN_SIZE);
+  m->refs = SCENES;
+  FOREACH(i, scenes) {
+    scenes[i].events = m;
+  }
+  return true;
+}
+
+// events that can be written, copying them if shared
+// returns NULL if they can't be copied
+event_map_t *scene_events_mut(scene_t *s) {
+  if(s->events->refs > 1) {
+    event_map_t *m = event_map_clone(s->events);
+    if(!m) {
+      printf("can't copy scene events\n");
+      return NULL;
+    }
+    event_map_release(s->events);
+    s->events = m;
+  }
+  return s->events;
+}
+
+// replace dst with src, sharing its contents
+void scene_copy(scene_t *dst, scene_t *src) {
+  if(dst == src) return;
+  note_grid_copy(&dst->notes, &src->notes);
+  src->events->refs++;
+  event_map_release(dst->events);
+  dst->events = src->events;
+}
+
+void scene_clear(scene_t *s) {
+  note_grid_clear(&s->notes);
+  if(s->events->refs > 1) {
+    event_map_t *m = event_map_new(s->events->max_size);
+    if(m && event_map_reserve(m, EVENT_MAP_MIN_SIZE)) {
+      event_map_release(s->events);
+      s->events = m;
+      return;
+    }
+    event_map_release(m);
+  }
+  event_map_t *m = scene_events_mut(s);
+  if(m) event_map_clear(m);
+}
+
+TEST(scene) {
+  vec128b v;
+  vec128b_set_zero(&v);
+  vec128b_set_bit(&v, 60);
+  note_pages_reset();
+  if(!scenes_init()) return -1;
+  note_grid_or(&scenes[0].notes, 1, 10, &v);
+  event_map_insert(scene_events_mut(&scenes[0]), (event_t) { .beat = 10, .msg = {0x91, 60, 100} });
+  scene_copy(&scenes[1], &scenes[0]);
+  if(scenes[1].events != scenes[0].events || note_pages_in_use() != 1) return -2;
+
+  // the first write to each copies only what it writes to
+  event_map_t *m = scene_events_mut(&scenes[1]);
+  if(m == scenes[0].events) return -3;
+  event_map_insert(m, (event_t) { .beat = 11, .msg = {0x91, 61, 100} });
+  if(event_map_count(scenes[0].events) != 1 || event_map_count(scenes[1].events) != 2) return -4;
+  note_grid_or(&scenes[1].notes, 1, 11, &v);
+  if(note_pages_in_use() != 2) return -5;
+  if(note_grid_beat_occupied(&scenes[0].notes, 1, 11)) return -6;
+
+  scene_clear(&scenes[1]);
+  if(event_map_count(scenes[0].events) != 1 || note_pages_in_use() != 1) return -7;
+  scenes_free();
+  if(note_pages_in_use() != 0) return -8;
+  return 0;
+}
+
+// the beat in the channel's loop for beat b of the image
+static
+unsigned int image_beat(const scene_image_t *img, unsigned int b, unsigned int channel) {
+  return (img->page * BEATS_PER_PAGE + b) % img->len[channel];
+}
+
+bool scene_image_valid(const scene_image_t *img, const scene_t *s, const unsigned int *len, int page, int transpose) {
+  return
+    img->page == page &&
+    img->transpose == transpose &&
+    img->scene == s &&
+    memcmp(img->len, len, sizeof(img->len)) == 0;
+}
+
+// copy a page of the scene, with each channel's loop length in len
+void scene_image_build(scene_image_t *img, const scene_t *s, const unsigned int *len, int page, int transpose) {
+  img->page = page;
+  img->transpose = transpose;
+  img->scene = s;
+  img->direct = false;
+  memcpy(img->len, len, sizeof(img->len));
+  event_map_merge(s->events);
+  COUNTUP(c, 16) {
+    img->channel_page[c] = page * BEATS_PER_PAGE % len[c] / BEATS_PER_PAGE;
+  }
+  unsigned int cnt = 0;
+  COUNTUP(b, BEATS_PER_PAGE) {
+    COUNTUP(c, 16) {
+      unsigned int sb = image_beat(img, b, c);
+      vec128b *v = &img->notes[b][c];
+      *v = *note_grid_get(&s->notes, c, sb);
+      if(transpose >= 0) {
+        vec128b_shiftl(v, transpose);
+      } else {
+        vec128b_shiftr(v, -transpose);
+      }
+      img->start[b * 16 + c] = cnt;
+      size_t n;
+      const event_t *e = event_map_at(s->events, c, sb, &n);
+      COUNTUP(j, n) {
+        if(e[j].flags & EVENT_DELETED) continue;
+        if(cnt >= SCENE_IMAGE_EVENTS) img->direct = true;
+        else img->event[cnt++] = e[j];
+      }
+    }
+  }
+  img->start[BEATS_PER_PAGE * 16] = cnt;
+}
+
+// the scene was written at the channel's beat, which might be cached
+void scene_image_written(scene_image_t *img, unsigned int channel, unsigned int beat) {
+  if(img->page >= 0 && beat / BEATS_PER_PAGE == img->channel_page[channel]) {
+    img->page = -1;
+  }
+}
+
+// the number of events on the channel at beat b of the image
+size_t scene_image_count(const scene_image_t *img, unsigned int b, unsigned int channel) {
+  if(img->direct) {
+    size_t n;
+    event_map_at(img->scene->events, channel, image_beat(img, b, channel), &n);
+    return n;
+  }
+  return img->start[b * 16 + channel + 1] - img->start[b * 16 + channel];
+}
+
+// the jth of those events, transposed, returns false if it's deleted or out of range
+// Events read from the scene are looked up each time, because writing to the scene can move them,
+// but only ever adds to the end of each beat.
+bool scene_image_event(const scene_image_t *img, unsigned int b, unsigned int channel, size_t j, event_t *e) {
+  if(img->direct) {
+    size_t n;
+    *e = event_map_at(img->scene->events, channel, image_beat(img, b, channel), &n)[j];
+    if(e->flags & EVENT_DELETED) return false;
+  } else {
+    *e = img->event[img->start[b * 16 + channel] + j];
+  }
+  if((e->msg[0] & 0xf0) == 0x90) {
+    int note = e->msg[1] + img->transpose;
+    if(!INRANGE(note, 0, 127)) return false;
+    e->msg[1] = note;
+  }
+  return true;
+}
+
+TEST(scene_image) {
+  static scene_image_t img;
+  unsigned int len[16];
+  vec128b v;
+  vec128b_set_zero(&v);
+  vec128b_set_bit(&v, 60);
+  note_pages_reset();
+  if(!scenes_init()) return -1;
+  scene_t *s = &scenes[0];
+  FOREACH(c, len) len[c] = BEATS;
+  note_grid_or(&s->notes, 1, BEATS_PER_PAGE + 2, &v);
+  COUNTUP(i, SCENE_IMAGE_EVENTS) {
+    event_map_insert(scene_events_mut(s), (event_t) { .beat = BEATS_PER_PAGE + 3, .msg = {0x91, i % 120, 100} });
+  }
+
+  scene_image_build(&img, s, len, 1, 2);
+  event_t e;
+  if(img.direct || !vec128b_bit_is_set(&img.notes[2][1], 62)) return -2;
+  if(scene_image_count(&img, 3, 1) != SCENE_IMAGE_EVENTS ||
+     !scene_image_event(&img, 3, 1, 5, &e) || e.msg[1] != 7) return -3;
+
+  // a page with more events is read from the scene
+  event_map_insert(scene_events_mut(s), (event_t) { .beat = BEATS_PER_PAGE + 3, .msg = {0x91, 127, 100} });
+  if(!scene_image_valid(&img, s, len, 1, 2)) return -4;
+  scene_image_written(&img, 1, BEATS_PER_PAGE + 3);
+  if(scene_image_valid(&img, s, len, 1, 2)) return -5;
+  scene_image_build(&img, s, len, 1, 2);
+  if(!img.direct || scene_image_count(&img, 3, 1) != SCENE_IMAGE_EVENTS + 1 ||
+     !scene_image_event(&img, 3, 1, 5, &e) || e.msg[1] != 7 ||
+     scene_image_event(&img, 3, 1, SCENE_IMAGE_EVENTS, &e)) return -6;
+  scenes_free();
+  return 0;
+}
@@ -22,6 +22,7 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <time.h>
 
 #if INTERFACE
 #include <stdio.h>
@@ -540,6 +541,13 @@ unsigned int int_log2l(long unsigned int x) {
   return x <= 1 ? 0 : sizeof_bits(x) - __builtin_clzl(x - 1);
 }
 
+/** Monotonic time in nanoseconds, for timing benchmarks. */
+long long time_ns() {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec * 1000000000ll + t.tv_nsec;
+}
+
 /** Insert into a set.
  * O(1) time.
  * @param x to insert
@@ -3,6 +3,16 @@
 
 #include <stdbool.h>
 
+// Define VEC128B_SCALAR to use the word by word versions even if SIMD is available.
+#if !defined(VEC128B_SCALAR) && defined(__SSE2__)
+#include <emmintrin.h>
+#define VEC128B_SSE2 1
+#elif !defined(VEC128B_SCALAR) && defined(__ARM_NEON) && defined(__ORDER_LITTLE_ENDIAN__) && \
+  __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#include <arm_neon.h>
+#define VEC128B_NEON 1
+#endif
+
 #define WORD_BITS (sizeof(unsigned int) * 8)
 #define VEC128B_WORDS (128 / WORD_BITS)
 
@@ -11,7 +21,7 @@ typedef struct {
 } vec128b;
 
 static inline
-void vec128b_and(vec128b *a, const vec128b *b) {
+void vec128b_and_scalar(vec128b *a, const vec128b *b) {
 #pragma GCC unroll (16 / sizeof(unsigned int))
 #pragma unroll
   FOREACH(i, a->word) {
@@ -20,7 +30,7 @@ void vec128b_and(vec128b *a, const vec128b *b) {
 }
 
 static inline
-void vec128b_and_not(vec128b *a, const vec128b *b) {
+void vec128b_and_not_scalar(vec128b *a, const vec128b *b) {
 #pragma GCC unroll (16 / sizeof(unsigned int))
 #pragma unroll
   FOREACH(i, a->word) {
@@ -29,7 +39,7 @@ void vec128b_and_not(vec128b *a, const vec128b *b) {
 }
 
 static inline
-void vec128b_or(vec128b *a, const vec128b *b) {
+void vec128b_or_scalar(vec128b *a, const vec128b *b) {
 #pragma GCC unroll (16 / sizeof(unsigned int))
 #pragma unroll
   FOREACH(i, a->word) {
@@ -38,7 +48,7 @@ void vec128b_or(vec128b *a, const vec128b *b) {
 }
 
 static inline
-void vec128b_xor(vec128b *a, const vec128b *b) {
+void vec128b_xor_scalar(vec128b *a, const vec128b *b) {
 #pragma GCC unroll (16 / sizeof(unsigned int))
 #pragma unroll
   FOREACH(i, a->word) {
@@ -47,7 +57,7 @@ void vec128b_xor(vec128b *a, const vec128b *b) {
 }
 
 static inline
-void vec128b_not(vec128b *a) {
+void vec128b_not_scalar(vec128b *a) {
 #pragma GCC unroll (16 / sizeof(unsigned int))
 #pragma unroll
   FOREACH(i, a->word) {
@@ -75,7 +85,7 @@ void vec128b_set_bit_val(vec128b *s, int k, bool v) {
 }
 
 static inline
-bool vec128b_eq(const vec128b *a, const vec128b *b) {
+bool vec128b_eq_scalar(const vec128b *a, const vec128b *b) {
   bool res = true;
 #pragma GCC unroll (16 / sizeof(unsigned int))
 #pragma unroll
@@ -86,7 +96,7 @@ bool vec128b_eq(const vec128b *a, const vec128b *b) {
 }
 
 static inline
-bool vec128b_zero(const vec128b *a) {
+bool vec128b_zero_scalar(const vec128b *a) {
   bool res = true;
 #pragma GCC unroll (16 / sizeof(unsigned int))
 #pragma unroll
@@ -97,7 +107,7 @@ bool vec128b_zero(const vec128b *a) {
 }
 
 static inline
-void vec128b_shiftl(vec128b *a, int b) {
+void vec128b_shiftl_scalar(vec128b *a, int b) {
   const int word_shiftl = b / WORD_BITS;
   const int bit_shiftl = b - word_shiftl * WORD_BITS;
   const int bit_shiftr = WORD_BITS - bit_shiftl;
@@ -121,7 +131,7 @@ void vec128b_shiftl(vec128b *a, int b) {
 }
 
 static inline
-void vec128b_shiftr(vec128b *a, int b) {
+void vec128b_shiftr_scalar(vec128b *a, int b) {
   const int word_shiftr = b / WORD_BITS;
   const int bit_shiftr = b - word_shiftr * WORD_BITS;
   const int bit_shiftl = WORD_BITS - bit_shiftr;
@@ -144,6 +154,135 @@ void vec128b_shiftr(vec128b *a, int b) {
   }
 }
 
+// Bit i of the set is bit i of a little endian 128 bit integer, so shifts move bits across lanes.
+
+#if VEC128B_SSE2
+typedef __m128i vec128b_v;
+
+static inline vec128b_v vec128b_load(const vec128b *a) { return _mm_loadu_si128((const __m128i *)a); }
+static inline void vec128b_store(vec128b *a, vec128b_v x) { _mm_storeu_si128((__m128i *)a, x); }
+static inline vec128b_v vec128b_v_and(vec128b_v a, vec128b_v b) { return _mm_and_si128(a, b); }
+static inline vec128b_v vec128b_v_and_not(vec128b_v a, vec128b_v b) { return _mm_andnot_si128(b, a); }
+static inline vec128b_v vec128b_v_or(vec128b_v a, vec128b_v b) { return _mm_or_si128(a, b); }
+static inline vec128b_v vec128b_v_xor(vec128b_v a, vec128b_v b) { return _mm_xor_si128(a, b); }
+static inline vec128b_v vec128b_v_not(vec128b_v a) { return _mm_xor_si128(a, _mm_set1_epi32(-1)); }
+
+static inline
+bool vec128b_v_zero(vec128b_v a) {
+  return _mm_movemask_epi8(_mm_cmpeq_epi8(a, _mm_setzero_si128())) == 0xffff;
+}
+
+// 64 bit lane shifts give zero for counts of 64 or more, including negative counts,
+// so both halves of the split are computed without branches
+static inline
+vec128b_v vec128b_v_shiftl(vec128b_v a, int b) {
+  vec128b_v lo = _mm_slli_si128(a, 8); // low lane moved up
+  return _mm_or_si128(_mm_or_si128(_mm_sll_epi64(a, _mm_cvtsi32_si128(b)),
+                                   _mm_srl_epi64(lo, _mm_cvtsi32_si128(64 - b))),
+                      _mm_sll_epi64(lo, _mm_cvtsi32_si128(b - 64)));
+}
+
+static inline
+vec128b_v vec128b_v_shiftr(vec128b_v a, int b) {
+  vec128b_v hi = _mm_srli_si128(a, 8); // high lane moved down
+  return _mm_or_si128(_mm_or_si128(_mm_srl_epi64(a, _mm_cvtsi32_si128(b)),
+                                   _mm_sll_epi64(hi, _mm_cvtsi32_si128(64 - b))),
+                      _mm_srl_epi64(hi, _mm_cvtsi32_si128(b - 64)));
+}
+#endif
+
+#if VEC128B_NEON
+typedef uint64x2_t vec128b_v;
+
+static inline vec128b_v vec128b_load(const vec128b *a) { return vreinterpretq_u64_u32(vld1q_u32(a->word)); }
+static inline void vec128b_store(vec128b *a, vec128b_v x) { vst1q_u32(a->word, vreinterpretq_u32_u64(x)); }
+static inline vec128b_v vec128b_v_and(vec128b_v a, vec128b_v b) { return vandq_u64(a, b); }
+static inline vec128b_v vec128b_v_and_not(vec128b_v a, vec128b_v b) { return vbicq_u64(a, b); }
+static inline vec128b_v vec128b_v_or(vec128b_v a, vec128b_v b) { return vorrq_u64(a, b); }
+static inline vec128b_v vec128b_v_xor(vec128b_v a, vec128b_v b) { return veorq_u64(a, b); }
+static inline vec128b_v vec128b_v_not(vec128b_v a) { return vreinterpretq_u64_u32(vmvnq_u32(vreinterpretq_u32_u64(a))); }
+
+static inline
+bool vec128b_v_zero(vec128b_v a) {
+  return !(vgetq_lane_u64(a, 0) | vgetq_lane_u64(a, 1));
+}
+
+// negative counts shift right, and shifting by 64 or more either way gives zero
+static inline
+vec128b_v vec128b_v_shiftl(vec128b_v a, int b) {
+  vec128b_v lo = vextq_u64(vdupq_n_u64(0), a, 1); // low lane moved up
+  return vorrq_u64(vshlq_u64(a, vdupq_n_s64(b)),
+                   vshlq_u64(lo, vdupq_n_s64(b - 64)));
+}
+
+static inline
+vec128b_v vec128b_v_shiftr(vec128b_v a, int b) {
+  vec128b_v hi = vextq_u64(a, vdupq_n_u64(0), 1); // high lane moved down
+  return vorrq_u64(vshlq_u64(a, vdupq_n_s64(-b)),
+                   vshlq_u64(hi, vdupq_n_s64(64 - b)));
+}
+#endif
+
+#if VEC128B_SSE2 || VEC128B_NEON
+#define VEC128B_SIMD 1
+
+static inline
+void vec128b_and(vec128b *a, const vec128b *b) {
+  vec128b_store(a, vec128b_v_and(vec128b_load(a), vec128b_load(b)));
+}
+
+static inline
+void vec128b_and_not(vec128b *a, const vec128b *b) {
+  vec128b_store(a, vec128b_v_and_not(vec128b_load(a), vec128b_load(b)));
+}
+
+static inline
+void vec128b_or(vec128b *a, const vec128b *b) {
+  vec128b_store(a, vec128b_v_or(vec128b_load(a), vec128b_load(b)));
+}
+
+static inline
+void vec128b_xor(vec128b *a, const vec128b *b) {
+  vec128b_store(a, vec128b_v_xor(vec128b_load(a), vec128b_load(b)));
+}
+
+static inline
+void vec128b_not(vec128b *a) {
+  vec128b_store(a, vec128b_v_not(vec128b_load(a)));
+}
+
+static inline
+bool vec128b_eq(const vec128b *a, const vec128b *b) {
+  return vec128b_v_zero(vec128b_v_xor(vec128b_load(a), vec128b_load(b)));
+}
+
+static inline
+bool vec128b_zero(const vec128b *a) {
+  return vec128b_v_zero(vec128b_load(a));
+}
+
+static inline
+void vec128b_shiftl(vec128b *a, int b) {
+  vec128b_store(a, vec128b_v_shiftl(vec128b_load(a), b));
+}
+
+static inline
+void vec128b_shiftr(vec128b *a, int b) {
+  vec128b_store(a, vec128b_v_shiftr(vec128b_load(a), b));
+}
+#else
+#define VEC128B_SIMD 0
+#define vec128b_and vec128b_and_scalar
+#define vec128b_and_not vec128b_and_not_scalar
+#define vec128b_or vec128b_or_scalar
+#define vec128b_xor vec128b_xor_scalar
+#define vec128b_not vec128b_not_scalar
+#define vec128b_eq vec128b_eq_scalar
+#define vec128b_zero vec128b_zero_scalar
+#define vec128b_shiftl vec128b_shiftl_scalar
+#define vec128b_shiftr vec128b_shiftr_scalar
+#endif
+
 static inline
 void vec128b_set_zero(vec128b *a) {
   memset(a, 0, sizeof(vec128b));
@@ -156,4 +295,49 @@ bool vec128b_bit_is_set(const vec128b *a, int b) {
   return !!(a->word[n] & (1u << bit));
 }
 
+static inline
+int vec128b_popcount(const vec128b *a) {
+  int n = 0;
+  FOREACH(i, a->word) {
+    n += __builtin_popcount(a->word[i]);
+  }
+  return n;
+}
+
+// lowest set bit, or -1 if empty
+static inline
+int vec128b_first_set(const vec128b *a) {
+  FOREACH(i, a->word) {
+    if(a->word[i]) return i * WORD_BITS + __builtin_ctz(a->word[i]);
+  }
+  return -1;
+}
+
+// highest set bit, or -1 if empty
+static inline
+int vec128b_last_set(const vec128b *a) {
+  COUNTDOWN(i, LENGTH(a->word)) {
+    if(a->word[i]) return i * WORD_BITS + (WORD_BITS - 1 - __builtin_clz(a->word[i]));
+  }
+  return -1;
+}
+
+// clear and return the lowest set bit, or -1 if empty
+static inline
+int vec128b_take_first(vec128b *a) {
+  FOREACH(i, a->word) {
+    unsigned int w = a->word[i];
+    if(w) {
+      a->word[i] = w & (w - 1);
+      return i * WORD_BITS + __builtin_ctz(w);
+    }
+  }
+  return -1;
+}
+
+/** Iterate `i` over each set bit of `*v` in increasing order. `*v` is copied first. */
+#define vec128b_foreach_set(i, v)                                       \
+  for(vec128b __set = *(v), *__setp = &__set; __setp; __setp = NULL)    \
+    for(int i; (i = vec128b_take_first(&__set)) >= 0; )
+
 #endif